@@ -0,0 +1,200 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <array>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+
+extern "C"
+{
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+}
+
+#include "common.hpp"
+#include "proto.hpp"
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+// Chats in flight at most, keeps the receivers' socket buffers from overflowing
+constexpr size_t WINDOW = 32;
+// A chat not everyone got by then counts as lost
+constexpr auto LOSS_TIMEOUT = 1s;
+
+struct BenchChat
+{
+  Header header;
+  uint64_t seq;
+  int64_t sent_ns;
+};
+
+struct BenchResult
+{
+  double seconds;
+  uint64_t delivered;
+  uint64_t lost;
+  std::vector<int64_t> latencies_ns;
+};
+
+void send_header(const File& socket, PacketType type)
+{
+  Header header{
+    .type = type,
+    .size = sizeof(Header),
+  };
+  send(int(socket), &header, sizeof(header), 0);
+}
+
+// One client chats, every other one measures how long it takes the server
+// to fan each message out to it
+BenchResult run_bench(const char* server, const char* port, size_t clients, uint64_t messages)
+{
+  std::vector<File> sockets;
+  for (size_t i = 0; i < clients; ++i)
+  {
+    sockets.push_back(create_dgram_socket(server, port));
+    send_header(sockets.back(), PacketType::REGISTER);
+  }
+  auto& sender = sockets.front();
+
+  // Give the server a moment to register everyone
+  usleep(200'000);
+
+  auto epoll = File{epoll_create1(0)};
+  VERIFY(epoll.valid());
+  for (size_t i = 1; i < clients; ++i)
+  {
+    VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, sockets[i], EPOLLIN) != -1);
+  }
+
+  auto heartbeat = make_timer(1);
+  VERIFY(heartbeat.valid());
+  VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, heartbeat, EPOLLIN) != -1);
+
+  const size_t receivers = clients - 1;
+  std::vector<uint32_t> received(messages, 0);
+  // Sequence numbers still waiting for someone, oldest first
+  std::deque<std::pair<uint64_t, Clock::time_point>> in_flight;
+
+  BenchResult result{};
+  result.latencies_ns.reserve(messages*receivers);
+
+  uint64_t next_seq = 0;
+  const auto start = Clock::now();
+
+  std::array<struct epoll_event, 64> events;
+  while (next_seq < messages || !in_flight.empty())
+  {
+    while (next_seq < messages && in_flight.size() < WINDOW)
+    {
+      const auto now = Clock::now();
+      BenchChat chat{
+        .header = {
+          .type = PacketType::CHAT,
+          .size = sizeof(BenchChat),
+        },
+        .seq = next_seq,
+        .sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count(),
+      };
+      if (send(int(sender), &chat, sizeof(chat), 0) != sizeof(chat))
+      {
+        VERIFY(errno == EAGAIN || errno == EWOULDBLOCK);
+        break;
+      }
+      in_flight.emplace_back(next_seq++, now);
+    }
+
+    auto ev_count = epoll_wait(int(epoll), events.data(), events.size(), 10);
+    VERIFY(ev_count != -1);
+
+    for (int i = 0; i < ev_count; ++i)
+    {
+      if (events[i].data.fd == int(heartbeat))
+      {
+        uint64_t count;
+        VERIFY(read(int(heartbeat), &count, sizeof(count)) != -1);
+        for (auto& socket : sockets)
+        {
+          send_header(socket, PacketType::HEARTBEAT);
+        }
+        continue;
+      }
+
+      BenchChat chat;
+      while (recv(events[i].data.fd, &chat, sizeof(chat), 0) == sizeof(chat))
+      {
+        if (chat.header.type != PacketType::CHAT || chat.seq >= messages) continue;
+
+        const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now().time_since_epoch()).count();
+        result.latencies_ns.push_back(now - chat.sent_ns);
+        ++result.delivered;
+        ++received[chat.seq];
+      }
+    }
+
+    const auto now = Clock::now();
+    while (!in_flight.empty())
+    {
+      auto [seq, sent] = in_flight.front();
+      if (received[seq] < receivers && now - sent < LOSS_TIMEOUT) break;
+
+      result.lost += receivers - received[seq];
+      in_flight.pop_front();
+    }
+  }
+
+  result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 5)
+  {
+    std::cout << "Usage: " << argv[0] << " <server> <clients> <messages> <port>..." << std::endl
+      << "Runs the same load against every port, e.g. one server per backend:" << std::endl
+      << "  task1_server 2000 epoll > /dev/null & task1_server 2001 uring > /dev/null &" << std::endl
+      << "  " << argv[0] << " localhost 16 20000 2000 2001" << std::endl;
+    return -1;
+  }
+
+  const size_t clients = std::strtoul(argv[2], nullptr, 10);
+  const uint64_t messages = std::strtoull(argv[3], nullptr, 10);
+  if (clients < 2 || messages == 0)
+  {
+    std::cout << "Need at least 2 clients and 1 message" << std::endl;
+    return -1;
+  }
+
+  std::cout << "port\tdatagrams/s\tp50 us\tp99 us\tmax us\tlost" << std::endl;
+  for (int i = 4; i < argc; ++i)
+  {
+    auto result = run_bench(argv[1], argv[i], clients, messages);
+
+    auto percentile =
+      [&](double p)
+      {
+        auto& latencies = result.latencies_ns;
+        if (latencies.empty()) return 0.0;
+
+        auto nth = latencies.begin() + static_cast<ptrdiff_t>(p*static_cast<double>(latencies.size() - 1));
+        std::nth_element(latencies.begin(), nth, latencies.end());
+        return static_cast<double>(*nth) / 1000.0;
+      };
+
+    std::cout << argv[i] << "\t"
+      << static_cast<uint64_t>(static_cast<double>(result.delivered) / result.seconds) << "\t\t"
+      << percentile(0.5) << "\t" << percentile(0.99) << "\t" << percentile(1.0) << "\t"
+      << result.lost << std::endl;
+  }
+
+  return 0;
+}
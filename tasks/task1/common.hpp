@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <optional>
 #include <utility>
 #include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <vector>
 
 extern "C"
 {
@@ -73,7 +77,7 @@ public:
   }
 };
 
-inline File pick_addrinfo_and_create_socket(addrinfo* list, bool client)
+inline File pick_addrinfo_and_create_socket(addrinfo* list, bool client, bool reuse_port)
 {
   for (auto info = list; info != nullptr; info = info->ai_next)
   {
@@ -96,6 +100,15 @@ inline File pick_addrinfo_and_create_socket(addrinfo* list, bool client)
     {
       // we are a server
 
+      // Several sockets share the port, the kernel spreads peers between
+      // them by address. Has to happen before bind.
+      int trueVal = 1;
+      if (reuse_port
+        && setsockopt(int(result), SOL_SOCKET, SO_REUSEPORT, &trueVal, sizeof(int)) == -1)
+      {
+        continue;
+      }
+
       // Receive packets from our chosen address
       if (bind(int(result), info->ai_addr, info->ai_addrlen) == -1)
       {
@@ -112,7 +125,8 @@ inline File pick_addrinfo_and_create_socket(addrinfo* list, bool client)
 
 inline File create_dgram_socket(
     const char *dst_addr,
-    const char *dst_port)
+    const char *dst_port,
+    bool reuse_port = false)
 {
   addrinfo hints{
       .ai_flags = dst_addr == nullptr ? AI_PASSIVE : 0,
@@ -129,7 +143,7 @@ inline File create_dgram_socket(
   VERIFY(getaddrinfo(dst_addr, dst_port, &hints, &list) != -1);
   Defer freelist{[&](){ freeaddrinfo(list); }};
   
-  File result = pick_addrinfo_and_create_socket(list, dst_addr != nullptr);
+  File result = pick_addrinfo_and_create_socket(list, dst_addr != nullptr, reuse_port);
   VERIFY(result.valid());
   
   VERIFY(fcntl(int(result), F_SETFL, O_NONBLOCK) != -1);
@@ -176,3 +190,194 @@ File make_timer(time_t interval_sec)
   
   return timer;
 }
+
+// One-shot, at an absolute time. steady_clock is CLOCK_MONOTONIC on Linux.
+inline bool set_timer_deadline(const File& timer, std::chrono::steady_clock::time_point when)
+{
+  const auto since_epoch = when.time_since_epoch();
+  const auto sec = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+
+  struct itimerspec spec{
+    .it_interval = {
+      .tv_sec = 0,
+      .tv_nsec = 0,
+    },
+    .it_value = {
+      .tv_sec = static_cast<time_t>(sec.count()),
+      .tv_nsec = static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - sec).count()),
+    },
+  };
+
+  return timerfd_settime(int(timer), TFD_TIMER_ABSTIME, &spec, nullptr) != -1;
+}
+
+// Timeouts hashed by deadline into a ring of buckets a tick apiece. Each
+// bucket is a linked list threaded through a pool of nodes, so scheduling,
+// rescheduling and cancelling are O(1), and advancing only visits the
+// buckets whose ticks went by. Deadlines more than a revolution away share
+// a bucket with nearer ones and are passed over until their lap comes.
+template<class Key>
+class TimingWheel
+{
+  using Clock = std::chrono::steady_clock;
+
+public:
+  using Handle = uint32_t;
+  static constexpr Handle NONE = UINT32_MAX;
+
+  TimingWheel(Clock::duration tick, size_t slots, Clock::time_point now = Clock::now())
+    : tick_{tick}
+    , epoch_{now}
+    , heads_(slots, NONE)
+  {}
+
+  size_t size() const { return size_; }
+
+  // Deadlines are rounded up to the next tick
+  Handle schedule(Key key, Clock::time_point deadline)
+  {
+    Handle handle;
+    if (free_ != NONE)
+    {
+      handle = free_;
+      free_ = nodes_[handle].next;
+    }
+    else
+    {
+      handle = static_cast<Handle>(nodes_.size());
+      nodes_.emplace_back();
+    }
+
+    nodes_[handle].key = std::move(key);
+    link(handle, deadline);
+    ++size_;
+    return handle;
+  }
+
+  void reschedule(Handle handle, Clock::time_point deadline)
+  {
+    unlink(handle);
+    link(handle, deadline);
+  }
+
+  void cancel(Handle handle)
+  {
+    unlink(handle);
+    release(handle);
+  }
+
+  // Calls on_expired(Key) for everything due by now. It may schedule new
+  // timeouts but must not cancel any.
+  template<class F>
+  void advance(Clock::time_point now, F on_expired)
+  {
+    if (now < epoch_) return;
+
+    const uint64_t target = static_cast<uint64_t>((now - epoch_) / tick_);
+    if (target < next_tick_) return;
+
+    // After a long sleep one revolution still visits every bucket
+    uint64_t tick = std::max(next_tick_, target + 1 >= heads_.size() ? target + 1 - heads_.size() : 0);
+    // Whatever gets scheduled from on_expired lands after now
+    next_tick_ = target + 1;
+
+    for (; tick <= target; ++tick)
+    {
+      Handle handle = heads_[tick % heads_.size()];
+      while (handle != NONE)
+      {
+        const Handle next = nodes_[handle].next;
+        if (nodes_[handle].tick <= target)
+        {
+          unlink(handle);
+          Key key = std::move(nodes_[handle].key);
+          release(handle);
+          on_expired(std::move(key));
+        }
+        handle = next;
+      }
+    }
+  }
+
+  // When the earliest non-empty bucket comes due. That bucket may only
+  // hold later laps, then advancing at that time just finds nothing.
+  std::optional<Clock::time_point> next_expiry() const
+  {
+    if (size_ == 0) return std::nullopt;
+
+    for (uint64_t tick = next_tick_; tick < next_tick_ + heads_.size(); ++tick)
+    {
+      if (heads_[tick % heads_.size()] != NONE)
+      {
+        return epoch_ + tick*tick_;
+      }
+    }
+    return std::nullopt;
+  }
+
+private:
+  struct Node
+  {
+    Key key{};
+    uint64_t tick{0};
+    Handle prev{NONE};
+    Handle next{NONE};
+  };
+
+  void link(Handle handle, Clock::time_point deadline)
+  {
+    uint64_t tick = 0;
+    if (deadline > epoch_)
+    {
+      tick = static_cast<uint64_t>((deadline - epoch_ + tick_ - Clock::duration{1}) / tick_);
+    }
+    // Buckets behind the cursor come around only after a full revolution
+    tick = std::max(tick, next_tick_);
+
+    auto& node = nodes_[handle];
+    auto& head = heads_[tick % heads_.size()];
+    node.tick = tick;
+    node.prev = NONE;
+    node.next = head;
+    if (head != NONE)
+    {
+      nodes_[head].prev = handle;
+    }
+    head = handle;
+  }
+
+  void unlink(Handle handle)
+  {
+    auto& node = nodes_[handle];
+    if (node.prev != NONE)
+    {
+      nodes_[node.prev].next = node.next;
+    }
+    else
+    {
+      heads_[node.tick % heads_.size()] = node.next;
+    }
+    if (node.next != NONE)
+    {
+      nodes_[node.next].prev = node.prev;
+    }
+  }
+
+  void release(Handle handle)
+  {
+    nodes_[handle].next = free_;
+    free_ = handle;
+    --size_;
+  }
+
+private:
+  Clock::duration tick_;
+  Clock::time_point epoch_;
+  // The first tick advance hasn't visited yet
+  uint64_t next_tick_{0};
+
+  std::vector<Handle> heads_;
+  std::vector<Node> nodes_;
+  Handle free_{NONE};
+  size_t size_{0};
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+}
+
+
+// A peer's address and port in binary, cheap to compare and hash. Only
+// logging ever needs the text form.
+struct Endpoint
+{
+  // IPv4 addresses take the first 4 bytes, the rest stays zero
+  std::array<uint8_t, 16> addr{};
+  // Network byte order
+  uint16_t port{0};
+  uint8_t family{AF_UNSPEC};
+
+  bool operator==(const Endpoint&) const = default;
+};
+
+inline Endpoint endpoint_of(const struct sockaddr_storage& storage)
+{
+  Endpoint result;
+  result.family = static_cast<uint8_t>(storage.ss_family);
+
+  if (storage.ss_family == AF_INET)
+  {
+    auto& in = reinterpret_cast<const struct sockaddr_in&>(storage);
+    std::memcpy(result.addr.data(), &in.sin_addr, sizeof(in.sin_addr));
+    result.port = in.sin_port;
+  }
+  else if (storage.ss_family == AF_INET6)
+  {
+    auto& in6 = reinterpret_cast<const struct sockaddr_in6&>(storage);
+    std::memcpy(result.addr.data(), &in6.sin6_addr, sizeof(in6.sin6_addr));
+    result.port = in6.sin6_port;
+  }
+
+  return result;
+}
+
+// "host:port" or "[host]:port", numeric, never hits a resolver
+inline std::string to_string(const Endpoint& endpoint)
+{
+  std::array<char, INET6_ADDRSTRLEN> host{};
+  if (inet_ntop(endpoint.family, endpoint.addr.data(), host.data(), host.size()) == nullptr)
+  {
+    return "?";
+  }
+
+  std::string result = endpoint.family == AF_INET6
+    ? "[" + std::string(host.data()) + "]"
+    : std::string(host.data());
+  return result + ":" + std::to_string(ntohs(endpoint.port));
+}
+
+inline uint64_t hash_endpoint(const Endpoint& endpoint)
+{
+  uint64_t lo;
+  uint64_t hi;
+  std::memcpy(&lo, endpoint.addr.data(), sizeof(lo));
+  std::memcpy(&hi, endpoint.addr.data() + sizeof(lo), sizeof(hi));
+
+  // Ports carry most of the entropy between peers behind one address
+  uint64_t h = lo ^ (hi * 0x9E3779B97F4A7C15ull)
+    ^ (uint64_t{endpoint.port} << 48) ^ (uint64_t{endpoint.family} << 40);
+
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return h;
+}
+
+// Open addressing with linear probing over a power-of-two table, at most
+// half full. Erasing shifts the following run back instead of leaving
+// tombstones, so lookups never get slower as clients come and go.
+template<class T>
+class EndpointMap
+{
+public:
+  using value_type = std::pair<Endpoint, T>;
+
+  template<class Slot, class Value>
+  class basic_iterator
+  {
+  public:
+    basic_iterator(Slot* slot, Slot* end) : slot_{slot}, end_{end} { skip(); }
+
+    Value& operator*() const { return **slot_; }
+    Value* operator->() const { return &**slot_; }
+
+    basic_iterator& operator++()
+    {
+      ++slot_;
+      skip();
+      return *this;
+    }
+
+    bool operator==(const basic_iterator& other) const { return slot_ == other.slot_; }
+
+  private:
+    void skip()
+    {
+      while (slot_ != end_ && !slot_->has_value()) ++slot_;
+    }
+
+    Slot* slot_;
+    Slot* end_;
+  };
+
+  using iterator = basic_iterator<std::optional<value_type>, value_type>;
+  using const_iterator = basic_iterator<const std::optional<value_type>, const value_type>;
+
+  EndpointMap() : slots_(16) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator begin() { return {slots_.data(), slots_.data() + slots_.size()}; }
+  iterator end() { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+  const_iterator begin() const { return {slots_.data(), slots_.data() + slots_.size()}; }
+  const_iterator end() const { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+
+  T* find(const Endpoint& key)
+  {
+    auto& slot = slots_[probe(key)];
+    return slot.has_value() ? &slot->second : nullptr;
+  }
+
+  bool contains(const Endpoint& key) const
+  {
+    return slots_[probe(key)].has_value();
+  }
+
+  // Leaves an existing value alone, like std::unordered_map's
+  std::pair<T*, bool> try_emplace(const Endpoint& key, T value)
+  {
+    if (auto existing = find(key)) return {existing, false};
+
+    if (2*(size_ + 1) > slots_.size())
+    {
+      grow();
+    }
+
+    auto& slot = slots_[probe(key)];
+    slot.emplace(key, std::move(value));
+    ++size_;
+    return {&slot->second, true};
+  }
+
+  bool erase(const Endpoint& key)
+  {
+    size_t i = probe(key);
+    if (!slots_[i].has_value()) return false;
+
+    erase_at(i);
+    return true;
+  }
+
+  // pred(const Endpoint&, T&), returns how many were erased
+  template<class F>
+  size_t erase_if(F pred)
+  {
+    size_t erased = 0;
+    for (size_t i = 0; i < slots_.size();)
+    {
+      if (slots_[i].has_value() && pred(std::as_const(slots_[i]->first), slots_[i]->second))
+      {
+        // Something from further along may have moved in here
+        erase_at(i);
+        ++erased;
+        continue;
+      }
+      ++i;
+    }
+    return erased;
+  }
+
+private:
+  size_t mask() const { return slots_.size() - 1; }
+  size_t home(const Endpoint& key) const { return hash_endpoint(key) & mask(); }
+
+  // The key's slot if present, otherwise the empty slot it would go to
+  size_t probe(const Endpoint& key) const
+  {
+    size_t i = home(key);
+    while (slots_[i].has_value() && slots_[i]->first != key)
+    {
+      i = (i + 1) & mask();
+    }
+    return i;
+  }
+
+  void erase_at(size_t i)
+  {
+    for (size_t j = (i + 1) & mask(); slots_[j].has_value(); j = (j + 1) & mask())
+    {
+      // An entry can move back to i only if that doesn't put it before its home
+      const size_t k = home(slots_[j]->first);
+      const bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+      if (stays) continue;
+
+      slots_[i] = std::move(slots_[j]);
+      i = j;
+    }
+
+    slots_[i].reset();
+    --size_;
+  }
+
+  void grow()
+  {
+    std::vector<std::optional<value_type>> old(slots_.size()*2);
+    old.swap(slots_);
+
+    for (auto& slot : old)
+    {
+      if (!slot.has_value()) continue;
+
+      slots_[probe(slot->first)] = std::move(slot);
+    }
+  }
+
+private:
+  std::vector<std::optional<value_type>> slots_;
+  size_t size_{0};
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+
+class MessagePool;
+
+// An immutable datagram shared by every queue it is fanned out to. The
+// bytes follow the header in the same allocation.
+class Message
+{
+  friend class MessagePool;
+  friend class MessageRef;
+
+public:
+  const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+  size_t size() const { return size_; }
+
+private:
+  Message(MessagePool* pool, uint8_t size_class) : pool_{pool}, size_class_{size_class} {}
+
+  char* bytes() { return reinterpret_cast<char*>(this + 1); }
+
+  MessagePool* pool_;
+  uint32_t refs_{0};
+  uint32_t size_{0};
+  uint8_t size_class_;
+};
+
+// Counted reference to a Message, the last one gives it back to its pool.
+// Not thread safe, a message stays with the thread that made it.
+class MessageRef
+{
+public:
+  MessageRef() = default;
+
+  MessageRef(const MessageRef& other) : message_{other.message_} { acquire(); }
+  MessageRef(MessageRef&& other) : message_{std::exchange(other.message_, nullptr)} {}
+
+  MessageRef& operator=(MessageRef other)
+  {
+    std::swap(message_, other.message_);
+    return *this;
+  }
+
+  ~MessageRef() { release(); }
+
+  const Message* operator->() const { return message_; }
+  const Message& operator*() const { return *message_; }
+  explicit operator bool() const { return message_ != nullptr; }
+
+private:
+  friend class MessagePool;
+
+  explicit MessageRef(Message* message) : message_{message} { acquire(); }
+
+  void acquire()
+  {
+    if (message_ != nullptr) ++message_->refs_;
+  }
+
+  inline void release();
+
+  Message* message_{nullptr};
+};
+
+// Free lists of messages in power-of-two size classes, so a short chat line
+// takes a short buffer and steady traffic stops hitting the allocator.
+// Has to outlive every MessageRef it handed out.
+class MessagePool
+{
+  static constexpr size_t MIN_CAPACITY = 64;
+
+public:
+  explicit MessagePool(size_t max_size)
+    : free_(std::bit_width(std::bit_ceil(std::max(max_size, MIN_CAPACITY)) / MIN_CAPACITY))
+  {}
+
+  MessagePool(const MessagePool&) = delete;
+  MessagePool& operator=(const MessagePool&) = delete;
+
+  ~MessagePool()
+  {
+    for (auto& list : free_)
+    {
+      for (auto message : list)
+      {
+        destroy(message);
+      }
+    }
+  }
+
+  // Copies bytes into a message of the smallest class that fits them
+  MessageRef make(std::span<const char> bytes)
+  {
+    const auto size_class = class_of(bytes.size());
+    auto& list = free_.at(size_class);
+
+    Message* message;
+    if (list.empty())
+    {
+      void* memory = ::operator new(sizeof(Message) + capacity_of(size_class));
+      message = new (memory) Message(this, static_cast<uint8_t>(size_class));
+    }
+    else
+    {
+      message = list.back();
+      list.pop_back();
+    }
+
+    std::memcpy(message->bytes(), bytes.data(), bytes.size());
+    message->size_ = static_cast<uint32_t>(bytes.size());
+    return MessageRef{message};
+  }
+
+private:
+  friend class MessageRef;
+
+  static size_t capacity_of(size_t size_class) { return MIN_CAPACITY << size_class; }
+
+  static size_t class_of(size_t size)
+  {
+    return std::bit_width(std::max(size, MIN_CAPACITY) - 1) - std::bit_width(MIN_CAPACITY - 1);
+  }
+
+  static void destroy(Message* message)
+  {
+    message->~Message();
+    ::operator delete(message);
+  }
+
+  void recycle(Message* message)
+  {
+    free_[message->size_class_].push_back(message);
+  }
+
+private:
+  std::vector<std::vector<Message*>> free_;
+};
+
+inline void MessageRef::release()
+{
+  if (message_ != nullptr && --message_->refs_ == 0)
+  {
+    message_->pool_->recycle(message_);
+  }
+  message_ = nullptr;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+// Bounded lock-free queue for many producers and one consumer. Every cell
+// carries a sequence number telling whose turn it is, so producers only
+// contend on the tail and the consumer never touches it. N has to be a
+// power of two.
+template<class T, size_t N>
+class MpscQueue
+{
+  static_assert((N & (N - 1)) == 0);
+
+  // Producers and the consumer shouldn't bounce one line between them
+  static constexpr size_t CACHE_LINE = 64;
+
+  struct Cell
+  {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+public:
+  MpscQueue() : cells_{std::make_unique<Cell[]>(N)}
+  {
+    for (size_t i = 0; i < N; ++i)
+    {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Calls fill(T&) on a claimed cell, false if the queue is full
+  template<class F>
+  bool try_push(F fill)
+  {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      auto& cell = cells_[pos & (N - 1)];
+      const size_t seq = cell.seq.load(std::memory_order_acquire);
+      const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+      if (diff == 0)
+      {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          fill(cell.value);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+      {
+        // The consumer hasn't freed this cell from the previous lap
+        return false;
+      }
+      else
+      {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Calls consume(const T&) on the oldest element, false if there is none
+  // or its producer is still filling it in
+  template<class F>
+  bool try_pop(F consume)
+  {
+    auto& cell = cells_[head_ & (N - 1)];
+    if (cell.seq.load(std::memory_order_acquire) != head_ + 1) return false;
+
+    consume(std::as_const(cell.value));
+    cell.seq.store(head_ + N, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+private:
+  std::unique_ptr<Cell[]> cells_;
+  alignas(CACHE_LINE) std::atomic<size_t> tail_{0};
+  alignas(CACHE_LINE) size_t head_{0};
+};
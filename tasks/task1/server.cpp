@@ -2,20 +2,32 @@
 #include <cstdio>
 #include <array>
 #include <vector>
-#include <unordered_map>
 #include <cstring>
 #include <string>
+#include <string_view>
+#include <span>
 #include <chrono>
 #include <deque>
+#include <memory>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <syncstream>
 
 extern "C"
 {
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 }
 
 #include "common.hpp"
 #include "proto.hpp"
+#include "endpoint.hpp"
+#include "message.hpp"
+#include "uring.hpp"
+#include "mpsc_queue.hpp"
 
 using namespace std::chrono_literals;
 using Clock = std::chrono::steady_clock;
@@ -24,39 +36,306 @@ struct Client
 {
   struct sockaddr_storage addr;
   socklen_t len = sizeof(addr);
-  std::deque<std::array<char, MAX_PACKET_SIZE>> outbound;
-  Clock::time_point last_heartbeat;
+  std::deque<MessageRef> outbound;
+  TimingWheel<Endpoint>::Handle expiry;
 };
 
-int main(int argc, char **argv)
+// Clients that go this long without a heartbeat are dropped
+constexpr auto CLIENT_TIMEOUT = 3s;
+
+// Datagrams moved per recvmmsg/sendmmsg call at most
+constexpr size_t BATCH_SIZE = 64;
+
+// Buffers and headers for one recvmmsg call, set up once and reused
+struct RecvBatch
 {
-  if (argc != 2)
+  std::array<std::array<char, MAX_PACKET_SIZE>, BATCH_SIZE> bufs;
+  std::array<struct sockaddr_storage, BATCH_SIZE> addrs;
+  std::array<struct iovec, BATCH_SIZE> iovs;
+  std::array<struct mmsghdr, BATCH_SIZE> msgs;
+
+  RecvBatch()
   {
-    std::cout << "Usage: " << argv[0] << " <listen port>" << std::endl;
-    return -1;
+    for (size_t i = 0; i < BATCH_SIZE; ++i)
+    {
+      iovs[i] = {
+        .iov_base = bufs[i].data(),
+        .iov_len = bufs[i].size(),
+      };
+      reset(i);
+    }
+  }
+
+  // recvmmsg overwrites the address lengths, they have to be put back
+  void reset(size_t i)
+  {
+    msgs[i] = {
+      .msg_hdr = {
+        .msg_name = &addrs[i],
+        .msg_namelen = sizeof(addrs[i]),
+        .msg_iov = &iovs[i],
+        .msg_iovlen = 1,
+        .msg_control = nullptr,
+        .msg_controllen = 0,
+        .msg_flags = 0,
+      },
+      .msg_len = 0,
+    };
+  }
+};
+
+// Workers print from their own threads, a line at a time
+inline std::osyncstream log_line()
+{
+  return std::osyncstream{std::cout};
+}
+
+// How much each syscall gets done, printed every few seconds when the
+// timer fires.
+// Timer reads are left out, both backends do the same ones.
+struct IoStats
+{
+  size_t worker{0};
+  const char* backend{""};
+  uint64_t recv_datagrams{0};
+  uint64_t send_datagrams{0};
+  uint64_t syscalls{0};
+
+  void print() const
+  {
+    const double per_syscall = syscalls == 0 ? 0.0
+      : static_cast<double>(recv_datagrams + send_datagrams) / static_cast<double>(syscalls);
+
+    log_line() << "worker " << worker << " " << backend << ": " << recv_datagrams << " datagrams in, "
+      << send_datagrams << " out, " << syscalls << " syscalls ("
+      << per_syscall << " datagrams per syscall)" << std::endl;
   }
+};
 
-  auto listener = create_dgram_socket(nullptr, argv[1]);
-  VERIFY(listener.valid());
+struct RelayedChat
+{
+  uint32_t size;
+  std::array<char, MAX_PACKET_SIZE> data;
+};
 
+// Chats other workers' clients said, waiting to be fanned out to this
+// worker's. Producers only ring the eventfd when the consumer may be
+// asleep, so a burst costs one wakeup.
+struct Inbox
+{
+  MpscQueue<RelayedChat, 1024> chats;
+  File wakeup{eventfd(0, EFD_NONBLOCK)};
+  std::atomic<bool> pending{false};
 
-  // Timeout people every 3 seconds
-  auto timer = make_timer(3);
-  VERIFY(timer.valid());
+  void push(std::span<const char> datagram)
+  {
+    const bool pushed = chats.try_push(
+      [&](RelayedChat& chat)
+      {
+        chat.size = static_cast<uint32_t>(datagram.size());
+        std::memcpy(chat.data.data(), datagram.data(), datagram.size());
+      });
+    // A worker that far behind loses chats like a full socket would
+    if (!pushed) return;
+
+    if (!pending.exchange(true, std::memory_order_acq_rel))
+    {
+      uint64_t one = 1;
+      VERIFY(write(int(wakeup), &one, sizeof(one)) != -1);
+    }
+  }
+};
+
+// Clients and what happens to their datagrams, whichever backend moves
+// them. With several workers each has one of these, the kernel hands it
+// the clients whose addresses hash to its socket.
+struct ChatServer
+{
+  File listener;
+  // One-shot, set for whenever the next wheel bucket comes due
+  File timer{timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)};
+  Inbox inbox;
+  // Every other worker's
+  std::vector<Inbox*> peers;
+  // Declared before the clients so that it outlives their queues
+  MessagePool messages{MAX_PACKET_SIZE};
+  EndpointMap<Client> alive_clients;
+  // A heartbeat just moves its client to a later bucket
+  TimingWheel<Endpoint> expiries{100ms, 64};
+  std::optional<Clock::time_point> timer_deadline;
+  IoStats stats;
+  Clock::time_point last_stats_print{Clock::now()};
+
+  // Returns whether anything was queued for sending
+  bool handle_datagram(std::span<const char> datagram,
+    const struct sockaddr_storage& addr, socklen_t addr_len)
+  {
+    auto* packet = reinterpret_cast<const Packet*>(datagram.data());
+    // The declared size has to cover at least the header and fit what arrived
+    if (datagram.size() < sizeof(Header)
+      || packet->header.size < sizeof(Header)
+      || packet->header.size > datagram.size())
+    {
+      return false;
+    }
+
+    const Endpoint endpoint = endpoint_of(addr);
+
+    if (packet->header.type == PacketType::REGISTER)
+    {
+      log_line() << to_string(endpoint) << " register." << std::endl;
+
+      auto [client, inserted] = alive_clients.try_emplace(endpoint,
+        Client{
+          .addr = addr,
+          .len = addr_len,
+          .outbound = {},
+          .expiry = TimingWheel<Endpoint>::NONE,
+        });
+      if (inserted)
+      {
+        client->expiry = expiries.schedule(endpoint, Clock::now() + CLIENT_TIMEOUT);
+        schedule_timer();
+      }
+      return false;
+    }
+
+    auto* sender = alive_clients.find(endpoint);
+    if (sender == nullptr)
+    {
+      log_line() << to_string(endpoint) << " -- unknown identifier!";
+      return false;
+    }
+
+    if (packet->header.type == PacketType::HEARTBEAT)
+    {
+      expiries.reschedule(sender->expiry, Clock::now() + CLIENT_TIMEOUT);
+    }
+    else if (packet->header.type == PacketType::CHAT)
+    {
+      std::string msg(reinterpret_cast<const char*>(packet->data),
+        packet->header.size - sizeof(Header));
+
+      log_line() << to_string(endpoint) << " says: " << msg << std::endl;
+
+      // One copy of the datagram, every queue just references it
+      auto message = messages.make({datagram.data(), packet->header.size});
+      for (auto&[id, client] : alive_clients)
+      {
+        if (&client == sender) continue;
+
+        client.outbound.push_back(message);
+      }
+
+      // And one per worker for everyone else
+      for (auto* peer : peers)
+      {
+        peer->push({message->data(), message->size()});
+      }
+      return true;
+    }
+
+    return false;
+  }
+
+  // Fans out what other workers relayed, returns whether anything was
+  // queued for sending. To be called after the wakeup fired.
+  bool drain_inbox()
+  {
+    uint64_t count;
+    VERIFY(read(int(inbox.wakeup), &count, sizeof(count)) != -1 || errno == EAGAIN);
+    // Cleared before looking, so a chat pushed from now on rings again
+    inbox.pending.exchange(false, std::memory_order_acq_rel);
+
+    bool queued = false;
+    auto fan_out =
+      [&](const RelayedChat& chat)
+      {
+        auto message = messages.make({chat.data.data(), chat.size});
+        for (auto&[id, client] : alive_clients)
+        {
+          client.outbound.push_back(message);
+          queued = true;
+        }
+      };
+    while (inbox.chats.try_pop(fan_out)) {}
+    return queued;
+  }
+
+  // Heartbeats only ever push the earliest expiry later, so the timer is
+  // moved when it has to fire sooner. Firing for a bucket that emptied out
+  // in the meantime costs one wakeup that finds nothing.
+  void schedule_timer()
+  {
+    const auto next = expiries.next_expiry();
+    if (!next || (timer_deadline && *timer_deadline <= *next)) return;
+
+    VERIFY(set_timer_deadline(timer, *next));
+    timer_deadline = next;
+  }
+
+  // To be called when the timer fires
+  void drop_timed_out()
+  {
+    uint64_t count;
+    // Moving the timer since it fired resets it
+    VERIFY(read(int(timer), &count, sizeof(count)) != -1 || errno == EAGAIN);
+
+    const auto now = Clock::now();
+    timer_deadline.reset();
+    expiries.advance(now,
+      [&](const Endpoint& endpoint)
+      {
+        log_line() << to_string(endpoint) << " timed out!" << std::endl;
+        alive_clients.erase(endpoint);
+      });
+    schedule_timer();
+
+    if (now - last_stats_print >= 3s)
+    {
+      stats.print();
+      last_stats_print = now;
+    }
+  }
+};
+
+void run_epoll(ChatServer& server)
+{
+  auto& listener = server.listener;
+  auto& alive_clients = server.alive_clients;
+  auto& stats = server.stats;
+  stats.backend = "epoll";
 
   auto epoll = File{epoll_create1(0)};
   VERIFY(epoll.valid());
 
   VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, listener, EPOLLIN) != -1);
-  VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, timer, EPOLLIN) != -1);
+  VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, server.timer, EPOLLIN) != -1);
+  VERIFY(epoll_ctl<EPOLL_CTL_ADD>(epoll, server.inbox.wakeup, EPOLLIN) != -1);
 
-  std::unordered_map<std::string, Client> alive_clients;
   bool any_outbound_messages = false;
 
+  auto schedule_send = [&]()
+    {
+      if (std::exchange(any_outbound_messages, true)) return;
+
+      VERIFY(epoll_ctl<EPOLL_CTL_MOD>(
+        epoll, listener, EPOLLIN | EPOLLOUT) != -1);
+      ++stats.syscalls;
+    };
+
+  // Too big for the stack
+  auto recv_batch = std::make_unique<RecvBatch>();
+  std::array<struct iovec, BATCH_SIZE> send_iovs;
+  std::array<struct mmsghdr, BATCH_SIZE> send_msgs;
+  // Whose front message each of send_msgs is
+  std::array<Client*, BATCH_SIZE> send_owners;
+
   std::array<struct epoll_event, 16> events;
   for (;;)
   {
     auto ev_count = epoll_wait(int(epoll), events.data(), events.size(), -1);
+    ++stats.syscalls;
 
     VERIFY(ev_count != -1);
 
@@ -64,128 +343,401 @@ int main(int argc, char **argv)
     {
       auto &event = events[i];
 
-      if (event.data.fd == int(timer))
+      if (event.data.fd == int(server.timer))
       {
-        uint64_t count;
-        VERIFY(read(int(timer), &count, sizeof(count)) != -1);
-
-        auto time = Clock::now();
-        for (auto it = alive_clients.begin(); it != alive_clients.end();)
+        server.drop_timed_out();
+      }
+      else if (event.data.fd == int(server.inbox.wakeup))
+      {
+        if (server.drain_inbox()) schedule_send();
+      }
+      else if (event.events & EPOLLIN)
+      {
+        // Drain everything the socket has, a batch per syscall
+        bool queued = false;
+        for (;;)
         {
-          if (time - it->second.last_heartbeat > 3s)
+          int count = recvmmsg(int(listener), recv_batch->msgs.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+          ++stats.syscalls;
+          if (count == -1)
           {
-            std::cout << it->first << " timed out!" << std::endl;
-            it = alive_clients.erase(it);
+            VERIFY(errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
           }
-          else
+
+          stats.recv_datagrams += count;
+
+          for (int k = 0; k < count; ++k)
           {
-            ++it;
+            auto& msg = recv_batch->msgs[k];
+            queued |= server.handle_datagram({recv_batch->bufs[k].data(), msg.msg_len},
+              recv_batch->addrs[k], msg.msg_hdr.msg_namelen);
+            recv_batch->reset(k);
           }
+
+          if (static_cast<size_t>(count) < BATCH_SIZE) break;
         }
+
+        if (queued) schedule_send();
       }
-      else if (event.events & EPOLLIN)
+      else if (event.events & EPOLLOUT)
       {
-        // packet from clinet
-        struct sockaddr_storage addr;
-        socklen_t len = sizeof(addr);
-        std::array<char, MAX_PACKET_SIZE> buf;
-        ssize_t recvd = recvfrom(int(listener), buf.data(), buf.size(), 0,
-          reinterpret_cast<struct sockaddr*>(&addr), &len);
-        VERIFY(recvd > 0);
-
-        auto* packet = reinterpret_cast<Packet*>(buf.data());
-
-        std::string identifier;
+        // Clients' queues are walked in order and flushed a batch per
+        // syscall. A short count means the socket buffer is full.
+        any_outbound_messages = false;
+        auto client_it = alive_clients.begin();
+        while (client_it != alive_clients.end())
         {
-          std::array<char, NI_MAXHOST> host;
-          std::array<char, NI_MAXSERV> serv;
-          auto s = getnameinfo(reinterpret_cast<struct sockaddr*>(&addr), len,
-            host.data(), host.size(), serv.data(), serv.size(), 0);
-          VERIFY(s != -1);
-
-          identifier += host.data();
-          identifier += ":";
-          identifier += serv.data();
-        }
+          // Everything before client_it has been sent, a batch starts at
+          // the front of its queue and may stop midway through another
+          size_t count = 0;
+          for (auto it = client_it; it != alive_clients.end() && count < BATCH_SIZE; ++it)
+          {
+            auto& client = it->second;
+            for (size_t k = 0; k < client.outbound.size() && count < BATCH_SIZE; ++k, ++count)
+            {
+              auto& message = client.outbound[k];
+              // sendmmsg only reads from it
+              send_iovs[count] = {
+                .iov_base = const_cast<char*>(message->data()),
+                .iov_len = message->size(),
+              };
+              send_msgs[count] = {
+                .msg_hdr = {
+                  .msg_name = &client.addr,
+                  .msg_namelen = client.len,
+                  .msg_iov = &send_iovs[count],
+                  .msg_iovlen = 1,
+                  .msg_control = nullptr,
+                  .msg_controllen = 0,
+                  .msg_flags = 0,
+                },
+                .msg_len = 0,
+              };
+              send_owners[count] = &client;
+            }
+          }
 
-        if (packet->header.type == PacketType::REGISTER)
-        {
-          std::cout << identifier << " register." << std::endl;
+          if (count == 0) break;
 
-          if (!alive_clients.contains(identifier))
+          int sent = sendmmsg(int(listener), send_msgs.data(), count, 0);
+          ++stats.syscalls;
+          if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
           {
-            alive_clients.emplace(identifier,
-              Client{
-                .addr = addr,
-                .len = len,
-                .outbound = {},
-                .last_heartbeat = Clock::now(),
-              });
+            // The first message failed for its own reasons, e.g. no route
+            // to that client. Dropped as it would be on the wire.
+            send_owners[0]->outbound.pop_front();
+            continue;
+          }
+          if (sent == -1)
+          {
+            sent = 0;
+          }
+          else
+          {
+            stats.send_datagrams += sent;
           }
-          continue;
-        }
-      
-        if (!alive_clients.contains(identifier))
-        {
-          std::cout << identifier << " -- unknown identifier!";
-          continue;
-        }
-        
-        if (packet->header.type == PacketType::HEARTBEAT)
-        {
-          alive_clients.at(identifier).last_heartbeat = Clock::now();
-        }
-        else if (packet->header.type == PacketType::CHAT)
-        {
-          std::string msg(reinterpret_cast<char*>(packet->data),
-            packet->header.size - sizeof(Header));
 
-          std::cout << identifier << " says: " << msg << std::endl;
+          // Messages of one client are consecutive and in queue order
+          for (int k = 0; k < sent; ++k)
+          {
+            send_owners[k]->outbound.pop_front();
+          }
 
-          for (auto&[id, client] : alive_clients)
+          if (static_cast<size_t>(sent) < count)
           {
-            if (identifier == id) continue;
-            
-            client.outbound.emplace_back(buf);
+            any_outbound_messages = true;
+            break;
+          }
+
+          while (client_it != alive_clients.end() && client_it->second.outbound.empty())
+          {
+            ++client_it;
           }
         }
 
-        if (!std::exchange(any_outbound_messages, true))
+        if (!any_outbound_messages)
         {
           VERIFY(epoll_ctl<EPOLL_CTL_MOD>(
-            epoll, listener, EPOLLIN | EPOLLOUT) != -1);
+            epoll, listener, EPOLLIN) != -1);
+          ++stats.syscalls;
         }
       }
-      else if (event.events & EPOLLOUT)
+    }
+  }
+}
+
+constexpr unsigned URING_ENTRIES = 256;
+// Receive buffers handed to the kernel, a power of two
+constexpr uint16_t URING_RECV_BUFFERS = 256;
+// Sends in flight at most, the rest wait in the clients' queues
+constexpr size_t URING_SEND_SLOTS = 128;
+
+// Completions of sends carry their slot index, these are the others
+constexpr uint64_t URING_RECV_TAG = ~uint64_t{0};
+constexpr uint64_t URING_TIMER_TAG = URING_RECV_TAG - 1;
+constexpr uint64_t URING_INBOX_TAG = URING_RECV_TAG - 2;
+
+// One multishot receive keeps delivering datagrams into provided buffers,
+// sends are queued as SQEs and go out together with the next wait, so a
+// loop iteration is a single io_uring_enter. Returns right away if the
+// kernel lacks any of that, before a single datagram has been touched.
+bool run_uring(ChatServer& server)
+{
+  auto& alive_clients = server.alive_clients;
+  auto& stats = server.stats;
+
+  Uring uring{URING_ENTRIES, 4*URING_ENTRIES};
+  if (!uring.valid()) return false;
+
+  // The kernel lays out each buffer as a header, the source address as
+  // long as recv_hdr allows, and then the payload
+  struct msghdr recv_hdr;
+  std::memset(&recv_hdr, 0, sizeof(recv_hdr));
+  recv_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+  constexpr uint32_t payload_offset = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage);
+
+  BufferRing buffers{uring, 0, URING_RECV_BUFFERS, payload_offset + MAX_PACKET_SIZE};
+  if (!buffers.valid()) return false;
+
+  stats.backend = "io_uring";
+
+  struct SendSlot
+  {
+    struct msghdr hdr;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    // Keeps the bytes alive until the kernel is done with them
+    MessageRef message;
+  };
+  std::vector<SendSlot> send_slots(URING_SEND_SLOTS);
+  std::vector<size_t> free_slots;
+  for (size_t i = 0; i < send_slots.size(); ++i)
+  {
+    free_slots.push_back(URING_SEND_SLOTS - 1 - i);
+  }
+
+  auto arm_recv = [&]()
+    {
+      auto* sqe = uring.get_sqe();
+      VERIFY(sqe != nullptr);
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = int(server.listener);
+      sqe->addr = reinterpret_cast<uint64_t>(&recv_hdr);
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = buffers.group();
+      sqe->user_data = URING_RECV_TAG;
+    };
+
+  auto arm_poll = [&](const File& file, uint64_t tag)
+    {
+      auto* sqe = uring.get_sqe();
+      VERIFY(sqe != nullptr);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = int(file);
+      sqe->poll32_events = POLLIN;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->user_data = tag;
+    };
+
+  // Takes one message per client per pass so that a busy client can't
+  // hog the slots, returns whether anything had to stay queued
+  auto queue_sends = [&]()
+    {
+      bool progress = true;
+      while (progress)
       {
-        any_outbound_messages = false;
-        for (auto&[_, client] : alive_clients)
+        progress = false;
+        for (auto&[id, client] : alive_clients)
+        {
+          if (client.outbound.empty()) continue;
+          if (free_slots.empty()) return true;
+
+          auto* sqe = uring.get_sqe();
+          if (sqe == nullptr) return true;
+
+          const size_t index = free_slots.back();
+          free_slots.pop_back();
+
+          auto& slot = send_slots[index];
+          slot.message = std::move(client.outbound.front());
+          client.outbound.pop_front();
+          slot.addr = client.addr;
+          // The kernel only reads from it
+          slot.iov = {
+            .iov_base = const_cast<char*>(slot.message->data()),
+            .iov_len = slot.message->size(),
+          };
+          slot.hdr = {
+            .msg_name = &slot.addr,
+            .msg_namelen = client.len,
+            .msg_iov = &slot.iov,
+            .msg_iovlen = 1,
+            .msg_control = nullptr,
+            .msg_controllen = 0,
+            .msg_flags = 0,
+          };
+
+          sqe->opcode = IORING_OP_SENDMSG;
+          sqe->fd = int(server.listener);
+          sqe->addr = reinterpret_cast<uint64_t>(&slot.hdr);
+          sqe->user_data = index;
+          progress = true;
+        }
+      }
+      return false;
+    };
+
+  arm_recv();
+  arm_poll(server.timer, URING_TIMER_TAG);
+  arm_poll(server.inbox.wakeup, URING_INBOX_TAG);
+
+  // New messages, or slots freed up while some were waiting for one
+  bool any_outbound_messages = false;
+  bool sends_waiting = false;
+  bool received_any = false;
+  for (;;)
+  {
+    if (std::exchange(any_outbound_messages, false))
+    {
+      sends_waiting = queue_sends();
+    }
+
+    const int submitted = uring.submit(1);
+    ++stats.syscalls;
+    // Busy means completions have to be reaped first
+    VERIFY(submitted >= 0 || submitted == -EBUSY);
+
+    bool unsupported = false;
+    uring.for_each_cqe(
+      [&](const struct io_uring_cqe& cqe)
+      {
+        if (cqe.user_data == URING_RECV_TAG)
         {
-          while (!client.outbound.empty())
+          if (cqe.res < 0)
           {
-            auto& buf = client.outbound.front();
-            Packet* packet = reinterpret_cast<Packet*>(buf.data());
-            if (sendto(int(listener), buf.data(), packet->header.size, 0,
-              reinterpret_cast<struct sockaddr*>(&client.addr), client.len)
-                != packet->header.size)
+            // Multishot receives are 6.0+
+            if (cqe.res == -EINVAL && !received_any)
             {
-              any_outbound_messages = true;
-              break;
+              unsupported = true;
+              return;
             }
-            client.outbound.pop_front();
+            // Out of buffers, they are back by the time it is re-armed
+            VERIFY(cqe.res == -ENOBUFS);
+          }
+          else
+          {
+            VERIFY(cqe.flags & IORING_CQE_F_BUFFER);
+            received_any = true;
+            ++stats.recv_datagrams;
+
+            const auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            char* buffer = buffers.buffer(id);
+            auto* out = reinterpret_cast<const struct io_uring_recvmsg_out*>(buffer);
+
+            struct sockaddr_storage addr;
+            const auto addr_len = static_cast<socklen_t>(std::min<size_t>(out->namelen, sizeof(addr)));
+            std::memcpy(&addr, buffer + sizeof(*out), addr_len);
+
+            const size_t len = std::min<size_t>(out->payloadlen, MAX_PACKET_SIZE);
+            any_outbound_messages |= server.handle_datagram({buffer + payload_offset, len}, addr, addr_len);
+            buffers.recycle(id);
           }
 
-          if (any_outbound_messages) break;
+          if (!(cqe.flags & IORING_CQE_F_MORE)) arm_recv();
         }
+        else if (cqe.user_data == URING_TIMER_TAG)
+        {
+          VERIFY(cqe.res >= 0);
 
-        if (!any_outbound_messages)
+          server.drop_timed_out();
+
+          if (!(cqe.flags & IORING_CQE_F_MORE)) arm_poll(server.timer, URING_TIMER_TAG);
+        }
+        else if (cqe.user_data == URING_INBOX_TAG)
         {
-          VERIFY(epoll_ctl<EPOLL_CTL_MOD>(
-            epoll, listener, EPOLLIN) != -1);
+          VERIFY(cqe.res >= 0);
+
+          any_outbound_messages |= server.drain_inbox();
+
+          if (!(cqe.flags & IORING_CQE_F_MORE)) arm_poll(server.inbox.wakeup, URING_INBOX_TAG);
         }
-      }
+        else
+        {
+          // Failed sends are dropped, as they would be on the wire
+          if (cqe.res >= 0) ++stats.send_datagrams;
+
+          send_slots[cqe.user_data].message = {};
+          free_slots.push_back(cqe.user_data);
+          any_outbound_messages |= sends_waiting;
+        }
+      });
+
+    if (unsupported) return false;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 4)
+  {
+    std::cout << "Usage: " << argv[0] << " <listen port> [epoll|uring] [workers]" << std::endl;
+    return -1;
+  }
+
+  const std::string_view backend = argc >= 3 ? argv[2] : "epoll";
+  if (backend != "epoll" && backend != "uring")
+  {
+    std::cout << "Unknown backend " << backend << std::endl;
+    return -1;
+  }
+
+  const size_t worker_count = argc == 4 ? std::strtoul(argv[3], nullptr, 10) : 1;
+  if (worker_count == 0)
+  {
+    std::cout << "Need at least one worker" << std::endl;
+    return -1;
+  }
+
+  // Every worker binds its own socket to the port
+  std::vector<std::unique_ptr<ChatServer>> servers;
+  for (size_t i = 0; i < worker_count; ++i)
+  {
+    auto& server = *servers.emplace_back(std::make_unique<ChatServer>());
+    server.listener = create_dgram_socket(nullptr, argv[1], worker_count > 1);
+    VERIFY(server.listener.valid());
+    VERIFY(server.timer.valid());
+    VERIFY(server.inbox.wakeup.valid());
+    server.stats.worker = i;
+  }
+
+  for (auto& server : servers)
+  {
+    for (auto& peer : servers)
+    {
+      if (peer != server) server->peers.push_back(&peer->inbox);
     }
   }
 
+  auto run = [&](ChatServer& server)
+    {
+      if (backend == "uring")
+      {
+        run_uring(server);
+        log_line() << "io_uring is not available, falling back to epoll" << std::endl;
+      }
+
+      run_epoll(server);
+    };
+
+  // Workers never return, the first one runs on the main thread
+  std::vector<std::jthread> workers;
+  for (size_t i = 1; i < worker_count; ++i)
+  {
+    workers.emplace_back(run, std::ref(*servers[i]));
+  }
+  run(*servers.front());
+
   return 0;
 }
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+extern "C"
+{
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+}
+
+#include "common.hpp"
+
+
+// Just enough of io_uring for a datagram server, talking to the kernel
+// directly so that there is nothing extra to install. Invalid when the
+// kernel says no, callers are expected to fall back to epoll then.
+class Uring
+{
+public:
+  Uring() = default;
+
+  Uring(unsigned entries, unsigned cq_entries)
+  {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    fd_ = File{static_cast<int>(syscall(__NR_io_uring_setup, entries, &params))};
+    if (!fd_.valid()) return;
+
+    // Older kernels map the rings separately
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+      || !(params.features & IORING_FEAT_NODROP))
+    {
+      fd_ = File{};
+      return;
+    }
+
+    ring_size_ = std::max(
+      params.sq_off.array + params.sq_entries*sizeof(uint32_t),
+      params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe));
+    ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, int(fd_), IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries*sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, int(fd_), IORING_OFF_SQES));
+    if (ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+    {
+      unmap();
+      fd_ = File{};
+      return;
+    }
+
+    auto* base = static_cast<char*>(ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+    // SQEs are used in ring order, so the indirection array never changes
+    auto* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i)
+    {
+      array[i] = i;
+    }
+  }
+
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  ~Uring() { unmap(); }
+
+  bool valid() const { return fd_.valid(); }
+  explicit operator int() const { return int(fd_); }
+
+  // A zeroed SQE, nullptr if the submission queue is full
+  struct io_uring_sqe* get_sqe()
+  {
+    const unsigned head = std::atomic_ref{*sq_head_}.load(std::memory_order_acquire);
+    if (sq_local_tail_ - head >= sq_entries_) return nullptr;
+
+    auto* sqe = &sqes_[sq_local_tail_++ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // Submits everything since the last call and waits for at least
+  // wait_for completions, returns -errno on failure
+  int submit(unsigned wait_for)
+  {
+    const unsigned pending = sq_local_tail_ - *sq_tail_;
+    std::atomic_ref{*sq_tail_}.store(sq_local_tail_, std::memory_order_release);
+
+    int result;
+    do
+    {
+      result = static_cast<int>(syscall(__NR_io_uring_enter, int(fd_), pending, wait_for,
+        wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    } while (result == -1 && errno == EINTR);
+
+    return result == -1 ? -errno : result;
+  }
+
+  // Calls f(const io_uring_cqe&) for every completion there is, returns how many
+  template<class F>
+  unsigned for_each_cqe(F f)
+  {
+    unsigned head = *cq_head_;
+    const unsigned tail = std::atomic_ref{*cq_tail_}.load(std::memory_order_acquire);
+
+    const unsigned count = tail - head;
+    for (; head != tail; ++head)
+    {
+      f(std::as_const(cqes_[head & cq_mask_]));
+    }
+
+    std::atomic_ref{*cq_head_}.store(head, std::memory_order_release);
+    return count;
+  }
+
+private:
+  void unmap()
+  {
+    if (ring_ != nullptr && ring_ != MAP_FAILED) munmap(ring_, ring_size_);
+    if (sqes_ != nullptr && sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    ring_ = nullptr;
+    sqes_ = nullptr;
+  }
+
+private:
+  File fd_;
+
+  void* ring_{nullptr};
+  size_t ring_size_{0};
+  struct io_uring_sqe* sqes_{nullptr};
+  size_t sqes_size_{0};
+
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned sq_entries_{0};
+  // SQEs handed out but not yet published
+  unsigned sq_local_tail_{0};
+
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  struct io_uring_cqe* cqes_{nullptr};
+};
+
+// Buffers the kernel picks from when a receive completes rather than when
+// it is submitted, which is what lets one multishot receive keep going.
+// count has to be a power of two.
+class BufferRing
+{
+public:
+  BufferRing(Uring& uring, uint16_t group, uint16_t count, uint32_t buffer_size)
+    : uring_{uring}
+    , group_{group}
+    , count_{count}
+    , buffer_size_{buffer_size}
+  {
+    ring_size_ = count*sizeof(struct io_uring_buf);
+    void* memory = mmap(nullptr, ring_size_ + size_t{count}*buffer_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return;
+
+    ring_ = static_cast<struct io_uring_buf_ring*>(memory);
+    buffers_ = static_cast<char*>(memory) + ring_size_;
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    // Before 5.19 there is no such thing
+    if (syscall(__NR_io_uring_register, int(uring), IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+      munmap(ring_, ring_size_ + size_t{count_}*buffer_size_);
+      ring_ = nullptr;
+      return;
+    }
+    registered_ = true;
+
+    for (uint16_t i = 0; i < count; ++i)
+    {
+      recycle(i);
+    }
+  }
+
+  BufferRing(const BufferRing&) = delete;
+  BufferRing& operator=(const BufferRing&) = delete;
+
+  ~BufferRing()
+  {
+    if (registered_)
+    {
+      struct io_uring_buf_reg reg;
+      std::memset(&reg, 0, sizeof(reg));
+      reg.bgid = group_;
+      syscall(__NR_io_uring_register, int(uring_), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if (ring_ != nullptr)
+    {
+      munmap(ring_, ring_size_ + size_t{count_}*buffer_size_);
+    }
+  }
+
+  bool valid() const { return registered_; }
+  uint16_t group() const { return group_; }
+
+  char* buffer(uint16_t id) { return buffers_ + size_t{id}*buffer_size_; }
+
+  // Gives a buffer back to the kernel once its contents have been handled
+  void recycle(uint16_t id)
+  {
+    // Not ring_->bufs, in C++ the header's flexible array trick puts
+    // that 8 bytes off from where the kernel looks
+    auto& slot = reinterpret_cast<struct io_uring_buf*>(ring_)[tail_ & (count_ - 1)];
+    slot.addr = reinterpret_cast<uint64_t>(buffer(id));
+    slot.len = buffer_size_;
+    slot.bid = id;
+    ++tail_;
+    std::atomic_ref{ring_->tail}.store(tail_, std::memory_order_release);
+  }
+
+private:
+  Uring& uring_;
+  uint16_t group_;
+  uint16_t count_;
+  uint32_t buffer_size_;
+
+  struct io_uring_buf_ring* ring_{nullptr};
+  size_t ring_size_{0};
+  char* buffers_{nullptr};
+  uint16_t tail_{0};
+  bool registered_{false};
+};
@@ -1,16 +1,26 @@
 #include <iostream>
 #include <spdlog/spdlog.h>
+#include <cfloat>
 #include <chrono>
+#include <map>
+#include <ctime>
 #include <unordered_set>
 
 #include "common/assert.hpp"
 #include "common/Service.hpp"
 #include "common/AsyncInput.hpp"
 #include "common/Allegro.hpp"
+#include "common/CircleBatch.hpp"
+#include "common/EventLoop.hpp"
+#include "common/ClockSync.hpp"
 #include "common/Replication.hpp"
+#include "common/bytestream.hpp"
+#include "common/LobbyIndex.hpp"
+#include "common/TimeSeries.hpp"
 #include "common/proto.hpp"
 
 #include "game/Entity.hpp"
+#include "game/ClientWorld.hpp"
 #include "game/gameProto.hpp"
 
 
@@ -32,22 +42,15 @@ ALLEGRO_COLOR colorToAllegro(uint32_t color)
 class Client
   : public Service<Client>
   , public Replication<Client>
+  , public ClockSync<Client>
   , public AsyncInput<Client>
   , public Allegro<Client>
 {
   using Clock = std::chrono::steady_clock;
 
-  struct Snapshot
-  {
-    GameState state;
-    Clock::time_point time;
-  };
-
-  struct PlayerInputSnapshot
-  {
-    glm::vec2 vel;
-    Clock::time_point time; 
-  };
+  // Samples kept per diagnostics series, a bit over a minute of frames
+  static constexpr size_t kDiagnosticsHistory = 2048;
+  using Series = TimeSeries<kDiagnosticsHistory>;
 
  public:
   Client()
@@ -56,25 +59,76 @@ class Client
     
   }
 
-  Entity* entityById(id_t id)
+  using Replication::handlePacket;
+  using ClockSync::handlePacket;
+
+  void handlePacket(ENetPeer*, enet_uint8, const PLobbyListUpdate& packet, std::span<LobbyEntry> cont)
   {
-    auto it = std::find_if(state_.begin(), state_.end(),
-      [id](const Entity& e) { return e.id == id; });
-    if (it == state_.end())
-      return nullptr;
-    
-    return &*it;
+    lobbies_.clear();
+    for (const auto& entry : cont)
+    {
+      lobbies_.emplace(entry.id, entry);
+    }
+    lobbyListVersion_ = packet.version;
+    lobbyTotal_ = packet.total;
+    sortLobbyPage();
   }
-  
-  using Replication::handlePacket;
 
-  void handlePacket(ENetPeer*, enet_uint8, const PLobbyListUpdate&, std::span<LobbyEntry> cont)
+  void handlePacket(ENetPeer*, enet_uint8, const PLobbyListDelta& packet, std::span<std::byte> cont)
   {
-    lobbies_.assign(cont.begin(), cont.end());
+    if (packet.version <= lobbyListVersion_) return;
+    lobbyListVersion_ = packet.version;
+    lobbyTotal_ = packet.total;
+
+    std::vector<LobbyEntry> added;
+    std::vector<LobbyCounts> updated;
+    std::vector<uint32_t> removed;
+    ByteIstream s(cont);
+    s >> added >> updated >> removed;
+
+    for (const auto& entry : added)
+    {
+      lobbies_.insert_or_assign(entry.id, entry);
+    }
+    for (const auto& counts : updated)
+    {
+      if (auto it = lobbies_.find(counts.id); it != lobbies_.end())
+      {
+        it->second.playerCount = counts.playerCount;
+        it->second.botCount = counts.botCount;
+      }
+    }
+    for (auto id : removed)
+    {
+      lobbies_.erase(id);
+    }
+    sortLobbyPage();
+  }
+
+  void sortLobbyPage()
+  {
+    lobbyPage_.clear();
+    for (const auto&[id, entry] : lobbies_)
+    {
+      lobbyPage_.push_back(&entry);
+    }
+    std::sort(lobbyPage_.begin(), lobbyPage_.end(),
+      [sort = lobbyQuery_.sort](const LobbyEntry* a, const LobbyEntry* b)
+      {
+        return LobbyIndex::before(sort, *a, *b);
+      });
+  }
+
+  void queryLobbies()
+  {
+    if (lobby_peer_ == nullptr) return;
+
+    send(lobby_peer_, 0, ENET_PACKET_FLAG_RELIABLE, PQueryLobbies{ .query = lobbyQuery_ });
   }
 
   void handlePacket(ENetPeer*, enet_uint8, const PJoinedLobby& packet)
   {
+    findingMatch_ = false;
     currentLobbyId_ = packet.id;
   }
 
@@ -101,7 +155,7 @@ class Client
 
   void handlePacket(ENetPeer*, enet_uint8, const PPossesEntity& packet)
   {
-    playerEntityId_ = packet.id;
+    world_.setPlayer(packet.id);
   }
 
   void handlePacket(ENetPeer*, enet_uint8, const PLobbyStarted& packet)
@@ -112,25 +166,39 @@ class Client
       {
         NG_VERIFY(server != nullptr);
         setupReplication(server, 1);
-        snapshotHistory_.emplace_back(Snapshot{ .time = Clock::now() });
+        startClockSync(server, 0);
+        world_.reset(Clock::now());
         server_peer_ = server;
-      });
+      },
+      packet.matchId);
   }
 
-  void handleReplication(ENetPeer*, enet_uint8, std::span<std::byte> bytes)
+  void disconnected(ENetPeer* peer)
   {
-    auto& newSnapshot = snapshotHistory_.emplace_back(snapshotHistory_.back());
-    newSnapshot.time = Clock::now();
+    spdlog::info("Disconnected from {}:{}", peer->address.host, peer->address.port);
+
+    if (peer == server_peer_)
+    {
+      // Otherwise we keep pinging a dead peer every second
+      stopClockSync(peer);
+      stopReplication(peer, 1);
+      server_peer_ = nullptr;
+    }
+  }
 
-    const auto count = bytes.size() / sizeof(Entity);
-    NG_ASSERT(bytes.size() % sizeof(Entity) == 0);
-    newSnapshot.state.resize(count);
-    std::memcpy(newSnapshot.state.data(), bytes.data(), bytes.size());
+  void handleReplication(ENetPeer* peer, enet_uint8 channel, std::span<std::byte> bytes, int64_t serverTime)
+  {
+    const auto arrival = Clock::now();
+    deltaSeries_.push(arrival, static_cast<float>(lastDeltaBytes(peer, channel)));
 
-    if (snapshotHistory_.size() > 10)
+    // Placed on the server's timeline once we know how its clock relates to ours,
+    // then network jitter doesn't leak into the interpolation
+    auto time = arrival;
+    if (auto clock = remoteClock(peer))
     {
-      snapshotHistory_.pop_front();
+      time = fromWireTime(clock->toLocal(serverTime));
     }
+    world_.onSnapshot(bytes, arrival, time);
   }
 
   void begin()
@@ -152,6 +220,11 @@ class Client
       }
       std::cout << std::endl;
     }
+    else if (line == "/dump" || line.starts_with("/dump "))
+    {
+      auto path = line.substr(std::min(line.size(), sizeof("/dump")));
+      dumpDiagnostics(std::string(path));
+    }
     else if (line == "/exit" && server_peer_ != nullptr)
     {
       close();
@@ -177,6 +250,7 @@ class Client
         NG_VERIFY(lobby != nullptr);
         send(lobby, 0, ENET_PACKET_FLAG_RELIABLE, PRegisterClientInLobby{});
         lobby_peer_ = lobby;
+        queryLobbies();
       });
   }
 
@@ -189,6 +263,7 @@ class Client
       };
     if (server_peer_ != nullptr)
     {
+      stopClockSync(server_peer_);
       disconnect(std::exchange(server_peer_, nullptr), cb);
     }
     else if (lobby_peer_ != nullptr)
@@ -207,22 +282,31 @@ class Client
     {
       close();
     }
+    else if (keycode == ALLEGRO_KEY_F3)
+    {
+      batchedDraw_ = !batchedDraw_;
+    }
+    else if (keycode == ALLEGRO_KEY_F2)
+    {
+      showDiagnostics_ = !showDiagnostics_;
+    }
   }
 
   void keyUp(int) {}
 
   void mouse(int x, int y)
   {
-    playerDesiredSpeed_ = {
+    glm::vec2 input{
         static_cast<float>(x - kWidth/2),
         static_cast<float>(y - kHeight/2)
       };
-    const float len = glm::length(playerDesiredSpeed_);
+    const float len = glm::length(input);
 
     if (len < 1e-3) return;
 
-    playerDesiredSpeed_ /= len;
-    playerDesiredSpeed_ *= std::clamp(len - 30, 0.f, 100.f)/100.f;
+    input /= len;
+    input *= std::clamp(len - 30, 0.f, 100.f)/100.f;
+    world_.setInput(input);
   }
 
   void drawGui()
@@ -236,7 +320,7 @@ class Client
         ImGui::SameLine();
         static int botCount = 10;
         ImGui::InputInt("Bots", &botCount);
-        if (botCount > 50) botCount = 50;
+        if (botCount > 10000) botCount = 10000;
         if (botCount < 0) botCount = 0;
 
         if (ImGui::Button("Create lobby")
@@ -247,14 +331,70 @@ class Client
             .botCount = static_cast<uint32_t>(botCount),
           });
         }
+
+        ImGui::SameLine();
+        if (!findingMatch_ && ImGui::Button("Find match"))
+        {
+          send(lobby_peer_, 0, ENET_PACKET_FLAG_RELIABLE, PFindMatch{ .botCount = static_cast<uint32_t>(botCount) });
+          findingMatch_ = true;
+          currentLobbyId_.reset();
+        }
+        else if (findingMatch_ && ImGui::Button("Stop searching"))
+        {
+          send(lobby_peer_, 0, ENET_PACKET_FLAG_RELIABLE, PCancelFindMatch{});
+          findingMatch_ = false;
+        }
       }
       
+      {
+        bool changed = ImGui::InputTextWithHint("##lobbyfilter", "Name starts with",
+          lobbyQuery_.namePrefix.data(), lobbyQuery_.namePrefix.size() - 1);
+        ImGui::SameLine();
+        int sort = static_cast<int>(lobbyQuery_.sort);
+        if (ImGui::Combo("Sort", &sort, "Newest\0Name\0Players\0"))
+        {
+          lobbyQuery_.sort = static_cast<LobbySort>(sort);
+          changed = true;
+        }
+        if (changed)
+        {
+          lobbyQuery_.offset = 0;
+        }
+
+        const uint32_t pageSize = lobbyQuery_.limit;
+        if (lobbyQuery_.offset == 0) ImGui::BeginDisabled();
+        if (ImGui::Button("<"))
+        {
+          lobbyQuery_.offset -= std::min(lobbyQuery_.offset, pageSize);
+          changed = true;
+        }
+        if (lobbyQuery_.offset == 0) ImGui::EndDisabled();
+        ImGui::SameLine();
+        const bool lastPage = lobbyQuery_.offset + pageSize >= lobbyTotal_;
+        if (lastPage) ImGui::BeginDisabled();
+        if (ImGui::Button(">"))
+        {
+          lobbyQuery_.offset += pageSize;
+          changed = true;
+        }
+        if (lastPage) ImGui::EndDisabled();
+        ImGui::SameLine();
+        ImGui::Text("%u-%u of %u", std::min(lobbyQuery_.offset + 1, lobbyTotal_),
+          std::min(lobbyQuery_.offset + pageSize, lobbyTotal_), lobbyTotal_);
+
+        if (changed)
+        {
+          queryLobbies();
+        }
+      }
+
       static constexpr uint32_t NONE = static_cast<uint32_t>(-1);
       static uint32_t selectedId = NONE;
       if (ImGui::BeginListBox("Lobbies"))
       {
-        for (auto& entry : lobbies_)
+        for (const auto* page : lobbyPage_)
         {
+          const auto& entry = *page;
           if (ImGui::Selectable(entry.name.data(), entry.id == selectedId))
           {
             selectedId = entry.id;
@@ -303,18 +443,83 @@ class Client
 
       ImGui::End();
     }
+
+    if (showDiagnostics_)
+    {
+      ImGui::Begin("Diagnostics");
+      plot("RTT, ms", rttSeries_);
+      plot("RTT variance, ms", rttVarianceSeries_);
+      plot("Packet loss, %", lossSeries_);
+      plot("Snapshot jitter, ms", jitterSeries_);
+      for (size_t i = 0; i < bandwidthSeries_.size(); ++i)
+      {
+        plot(i == 0 ? "In, channel 0, kbit/s" : "In, channel 1, kbit/s", *bandwidthSeries_[i]);
+      }
+      plot("Delta size, bytes", deltaSeries_);
+      plot("Interpolation delay, ms", delaySeries_);
+      plot("Buffer depth, ms", bufferDepthSeries_);
+      plot("Prediction error", predictionErrorSeries_);
+      plot("Frame time, ms", frameSeries_);
+      plot("Draw time, ms", drawSeries_);
+
+      if (ImGui::Button("Dump CSV"))
+      {
+        dumpDiagnostics({});
+      }
+      ImGui::End();
+    }
+  }
+
+  void plot(const char* label, const Series& series)
+  {
+    constexpr size_t kPlotSamples = 240;
+
+    plotScratch_.clear();
+    series.copyLatest(kPlotSamples, nullptr, plotScratch_);
+
+    std::array<char, 32> overlay;
+    std::snprintf(overlay.data(), overlay.size(), "%.2f", plotScratch_.empty() ? 0.f : plotScratch_.back());
+    ImGui::PlotLines(label, plotScratch_.data(), static_cast<int>(plotScratch_.size()), 0,
+      overlay.data(), FLT_MAX, FLT_MAX, ImVec2(0, 40));
+  }
+
+  void dumpDiagnostics(std::string path)
+  {
+    if (path.empty())
+    {
+      path = fmt::format("diagnostics_{}.csv", std::time(nullptr));
+    }
+    diagnostics_.dumpCsv(std::move(path));
+  }
+
+  void sampleNetwork()
+  {
+    const auto now = Clock::now();
+    const float secs = durationToSecs(now - std::exchange(lastNetworkSample_, now));
+
+    for (size_t i = 0; i < bandwidthSeries_.size(); ++i)
+    {
+      const auto received = receivedBytes(static_cast<enet_uint8>(i));
+      bandwidthSeries_[i]->push(now,
+        static_cast<float>(received - std::exchange(lastReceivedBytes_[i], received))*8.f/1000.f/secs);
+    }
+
+    if (server_peer_ == nullptr) return;
+
+    rttSeries_.push(now, static_cast<float>(server_peer_->roundTripTime));
+    rttVarianceSeries_.push(now, static_cast<float>(server_peer_->roundTripTimeVariance));
+    lossSeries_.push(now,
+      static_cast<float>(server_peer_->packetLoss) / static_cast<float>(ENET_PEER_PACKET_LOSS_SCALE) * 100.f);
+    jitterSeries_.push(now, world_.jitter().jitterMs());
+    delaySeries_.push(now, world_.jitter().delayMs());
   }
 
   void draw()
   {
     glm::vec2 playerPos{0, 0};
-    for (auto& entity : state_)
+    if (auto player = world_.entityById(world_.player()))
     {
-      if (entity.id == playerEntityId_)
-      {
-        playerPos = entity.pos;
-        break;
-      }
+      playerPos = player->pos;
     }
 
     float scale = static_cast<float>(kWidth + kHeight) / 2.f;
@@ -342,181 +547,146 @@ class Client
 
     }
 
-    for (auto& entity : state_)
-    {
-      auto p = worldToScreen(entity.pos);
-      al_draw_filled_circle(
-        p.x,
-        p.y,
-        entity.size*scale,
-        colorToAllegro(entity.color));
-    }
-
-    al_draw_text(getFont(), al_map_rgb(255, 255, 255), 0, 0, 0, "ESC = /exit; B = /begin");
-  }
+    const auto drawStart = Clock::now();
 
-  static float durationToSecs(Clock::duration d)
-  {
-    return std::chrono::duration_cast<std::chrono::duration<float>>(d).count();
-  }
-  
-  std::vector<Entity> interpolate(Clock::time_point time)
-  {
-    while (snapshotHistory_.size() > 2 && snapshotHistory_[1].time < time)
+    if (batchedDraw_)
     {
-      snapshotHistory_.pop_front();
+      circles_.begin(kWidth, kHeight);
+      for (auto& entity : world_.state())
+      {
+        auto p = worldToScreen(entity.pos);
+        circles_.add(p.x, p.y, entity.size*scale, colorToAllegro(entity.color));
+      }
+      circles_.flush();
     }
-    
-    if (snapshotHistory_.size() == 1)
+    else
     {
-      return snapshotHistory_.front().state;
+      for (auto& entity : world_.state())
+      {
+        auto p = worldToScreen(entity.pos);
+        al_draw_filled_circle(
+          p.x,
+          p.y,
+          entity.size*scale,
+          colorToAllegro(entity.color));
+      }
     }
-    else if (snapshotHistory_.size() >= 2)
-    {
-      auto& old = snapshotHistory_[0];
-      auto& recent = snapshotHistory_[1];
 
-      std::vector<Entity> result;
-      result.reserve(recent.state.size());
+    const auto drawEnd = Clock::now();
 
-      zipById(
-        std::span{old.state.data(), old.state.size()},
-        std::span{recent.state.data(), recent.state.size()},
-        [&result, to = old.time, tr = recent.time, time]
-        (const Entity& o, const Entity& r)
-        {
-          auto h = durationToSecs(time - to)
-            / durationToSecs(tr - to);
-          
-          result.emplace_back(Entity{
-              .pos = r.pos*h + (1 - h)*o.pos,
-              .size = r.size*h + (1 - h)*o.size,
-              .color = r.color,
-              .id = r.id,
-            });
-        });
+    // Smoothed, otherwise the numbers are unreadable
+    constexpr float kSmoothing = 0.05f;
+    drawMs_ += (durationToSecs(drawEnd - drawStart)*1000.f - drawMs_)*kSmoothing;
+    drawSeries_.push(drawEnd, durationToSecs(drawEnd - drawStart)*1000.f);
+    frameMs_ += (durationToSecs(drawEnd - std::exchange(lastFrame_, drawEnd))*1000.f - frameMs_)*kSmoothing;
 
-      return result;
+    al_draw_text(getFont(), al_map_rgb(255, 255, 255), 0, 0, 0, "ESC = /exit; B = /begin; F2 = diagnostics; F3 = toggle batching");
+    if (batchedDraw_)
+    {
+      al_draw_textf(getFont(), al_map_rgb(255, 255, 255), 0, 10, 0,
+        "frame %.2f ms, entities %.2f ms (batched: %zu/%zu drawn, %zu tris)",
+        frameMs_, drawMs_, circles_.drawn(), circles_.submitted(), circles_.triangles());
     }
-
-    return state_;
-  }
-
-  void interpolatePlayer(Clock::time_point now, float delta)
-  {
-    auto player = entityById(playerEntityId_);
-    if (player == nullptr)
+    else
     {
-      return;
+      al_draw_textf(getFont(), al_map_rgb(255, 255, 255), 0, 10, 0,
+        "frame %.2f ms, entities %.2f ms (immediate: %zu drawn)",
+        frameMs_, drawMs_, world_.state().size());
     }
-
-    auto& entity = *player;
-
-    playerVelHistory_.emplace_back(PlayerInputSnapshot{
-      .vel = playerDesiredSpeed_,
-      .time = now,
-    });
-    entity.vel = playerDesiredSpeed_;
-    entity.simulate(delta);
-    
-    if (playerServerPredicted.has_value())
+    const auto& jitter = world_.jitter();
+    al_draw_textf(getFont(), al_map_rgb(255, 255, 255), 0, 20, 0,
+      "interp delay %.0f ms (target %.0f), snapshot interval %.0f ms, jitter %.1f ms",
+      jitter.delayMs(), jitter.targetDelayMs(), jitter.intervalMs(), jitter.jitterMs());
+    if (auto clock = server_peer_ != nullptr ? remoteClock(server_peer_) : nullptr)
     {
-      playerServerPredicted->vel = playerDesiredSpeed_;
-      playerServerPredicted->simulate(delta);
-
-      glm::vec2 compensation =
-        (playerServerPredicted->pos - entity.pos) * delta;
-      if (glm::length(compensation) > entity.size/100.f)
-      {
-        entity.pos += compensation;
-        playerServerPredicted->pos -= compensation;
-      }
+      al_draw_textf(getFont(), al_map_rgb(255, 255, 255), 0, 30, 0,
+        "server clock offset %.3f ms, drift %.1f ppm, best rtt %.2f ms, transit %.1f ms",
+        clock->offsetUs() / 1000., clock->drift()*1e6, clock->bestRttUs() / 1000., jitter.transitMs());
     }
+  }
 
+  static float durationToSecs(Clock::duration d)
+  {
+    return std::chrono::duration_cast<std::chrono::duration<float>>(d).count();
+  }
+  
+  void frame()
+  {
+    auto now = Clock::now();
+    float delta = durationToSecs(now - std::exchange(lastUpdate_, now));
 
-    const auto& snapshot = snapshotHistory_.back();
+    // ENet's own timers (resends, pings, timeouts) need servicing even
+    // when nothing arrives
+    Service::poll(0);
+    Allegro::poll();
+    updateClockSync(now);
 
-    auto it = std::find_if(snapshot.state.begin(), snapshot.state.end(),
-      [this](const Entity& e) { return e.id == playerEntityId_; });
+    if (server_peer_ != nullptr)
+    {
+      world_.update(now, delta, server_peer_->roundTripTime * 1ms);
 
-    if (it == snapshot.state.end()) {
-      return;
+      bufferDepthSeries_.push(now, world_.bufferDepthMs());
+      predictionErrorSeries_.push(now, world_.predictionError());
     }
+    frameSeries_.push(now, delta*1000.f);
 
-    // std::chrono is f'n awesome
-    Clock::time_point last = snapshot.time - server_peer_->roundTripTime/2 * 1ms;
-    while (!playerVelHistory_.empty()
-      && playerVelHistory_.front().time < last)
-    {
-      playerVelHistory_.pop_front();
-    }
+    Allegro::render();
+  }
 
-    Entity predicted = entity;
-    predicted.pos = it->pos;
-    for (auto&[vel, time] : playerVelHistory_)
+  void sendInput()
+  {
+    if (server_peer_ == nullptr
+      || world_.player() == kInvalidId
+      || world_.input() == lastSentInput_)
     {
-      predicted.vel = vel;
-      predicted.simulate(durationToSecs(time - last));
-      last = time;
+      return;
     }
 
-    playerServerPredicted = predicted;
+    lastSentInput_ = world_.input();
+    auto packed = glm::packSnorm2x16(lastSentInput_);
+    replicate(server_peer_, 1, {reinterpret_cast<std::byte*>(&packed), sizeof(packed)});
+    // Out now rather than whenever the next frame polls the host
+    enet_host_flush(getHost());
   }
 
   void run()
   {
     constexpr auto kSendRate = 60ms;
+    constexpr auto kDiagnosticsRate = 250ms;
 
-    auto startTime = Clock::now();
-    auto currentTime = startTime;
-    auto lastSendTime = startTime;
+    lastUpdate_ = Clock::now();
+    lastNetworkSample_ = lastUpdate_;
 
-    while (!shouldStop_)
-    {
-      auto now = Clock::now();
-      float delta = durationToSecs(now - std::exchange(currentTime, now));
-
-      AsyncInput::poll();
-      Allegro::poll();
-      Service::poll();
-
-      if (server_peer_ != nullptr)
-      {
-        constexpr auto forcedLagMs = 250ms;
-        auto time = now - forcedLagMs;
-
-        std::optional<Entity> playerBackup;
-        if (auto player = entityById(playerEntityId_)) playerBackup = *player;
-
-        state_ = interpolate(time);
-        
-        if (auto player = entityById(playerEntityId_); player && playerBackup)
-        {
-            // keep local simulation position
-            player->pos = playerBackup->pos;
-        }
-        
-
-        interpolatePlayer(now, delta);
-      }
-
-      if (server_peer_ != nullptr
-        && playerEntityId_ != kInvalidId
-        && (now - lastSendTime) > kSendRate)
+    EventLoop loop;
+    NG_VERIFY(loop.watch(getHost()->socket,
+      [this, &loop]()
       {
-        auto sz = playerVelHistory_.size();
-        if (sz < 2
-          || glm::length(playerVelHistory_[sz - 1].vel - playerVelHistory_[sz - 2].vel) > 1e-3)
+        Service::poll(0);
+        if (shouldStop_) loop.stop();
+      }));
+    if (int fd = inputFd(); fd != -1)
+    {
+      const bool watched = loop.watch(fd,
+        [this, &loop, fd]()
         {
-          lastSendTime = now;
-          auto packed = glm::packSnorm2x16(playerDesiredSpeed_);
-          replicate(server_peer_, 1, {reinterpret_cast<std::byte*>(&packed), sizeof(packed)});
-        }
-      }
+          AsyncInput::poll();
+          if (inputFd() == -1) loop.unwatch(fd);
+        });
+      // Redirected from a file, which is always readable, so read it all now
+      if (!watched) AsyncInput::poll();
     }
+    loop.every(kFrameInterval,
+      [this, &loop]()
+      {
+        frame();
+        if (shouldStop_) loop.stop();
+      });
+    loop.every(kSendRate, [this]() { sendInput(); });
+    loop.every(kDiagnosticsRate, [this]() { sampleNetwork(); });
+
+    loop.run();
 
     Allegro::stop();
-    std::cout << "Press ENTER to exit..." << std::endl;
     AsyncInput::stop();
   }
 
@@ -524,21 +694,45 @@ class Client
   ENetPeer* lobby_peer_{nullptr};
   ENetPeer* server_peer_{nullptr};
 
-  std::vector<LobbyEntry> lobbies_;
+  // The subscribed page, and the same entries in query order
+  std::map<uint32_t, LobbyEntry> lobbies_;
+  std::vector<const LobbyEntry*> lobbyPage_;
+  LobbyQuery lobbyQuery_{ .namePrefix = {0}, .offset = 0, .limit = 20, .sort = LobbySort::Newest };
+  uint32_t lobbyTotal_{0};
+  uint64_t lobbyListVersion_{0};
   std::optional<uint32_t> currentLobbyId_;
+  bool findingMatch_{false};
 
   std::unordered_set<uint32_t> otherIds_;
   bool shouldStop_{false};
 
-  id_t playerEntityId_;
-  GameState state_;
-
-  std::deque<Snapshot> snapshotHistory_;
-
-  glm::vec2 playerDesiredSpeed_{0,0};
-  // kostyl: we don't have a predicted pos for the first few frames
-  std::optional<Entity> playerServerPredicted;
-  std::deque<PlayerInputSnapshot> playerVelHistory_; 
+  ClientWorld world_;
+  Clock::time_point lastUpdate_;
+  glm::vec2 lastSentInput_{0, 0};
+
+  CircleBatch circles_;
+  bool batchedDraw_{true};
+  float drawMs_{0};
+  float frameMs_{0};
+  Clock::time_point lastFrame_{Clock::now()};
+
+  bool showDiagnostics_{true};
+  TimeSeriesRecorder<kDiagnosticsHistory> diagnostics_;
+  Series& rttSeries_{diagnostics_.add("rtt_ms")};
+  Series& rttVarianceSeries_{diagnostics_.add("rtt_variance_ms")};
+  Series& lossSeries_{diagnostics_.add("loss_percent")};
+  Series& jitterSeries_{diagnostics_.add("snapshot_jitter_ms")};
+  std::array<Series*, 2> bandwidthSeries_{&diagnostics_.add("in_ch0_kbps"), &diagnostics_.add("in_ch1_kbps")};
+  Series& deltaSeries_{diagnostics_.add("delta_bytes")};
+  Series& delaySeries_{diagnostics_.add("interp_delay_ms")};
+  Series& bufferDepthSeries_{diagnostics_.add("buffer_depth_ms")};
+  Series& predictionErrorSeries_{diagnostics_.add("prediction_error")};
+  Series& frameSeries_{diagnostics_.add("frame_ms")};
+  Series& drawSeries_{diagnostics_.add("draw_ms")};
+
+  Clock::time_point lastNetworkSample_;
+  std::array<uint64_t, 2> lastReceivedBytes_{0, 0};
+  std::vector<float> plotScratch_;
 };
 
 
@@ -0,0 +1,264 @@
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "common/assert.hpp"
+#include "common/JobSystem.hpp"
+
+#include "game/ClientWorld.hpp"
+#include "game/EntityIndex.hpp"
+#include "game/Simulation.hpp"
+
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+static float durationToSecs(Clock::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::duration<float>>(d).count();
+}
+
+struct BenchConfig
+{
+  uint32_t entities;
+  float seconds;
+  float frameRate;
+  Clock::duration latency;
+  Clock::duration jitter;
+};
+
+// Runs a server simulation and a ClientWorld in one process on a simulated
+// clock, with snapshots and inputs going through a fake link that delays
+// them by latency plus uniform jitter. No sockets and no window, so the
+// client side runs as fast as the CPU allows.
+class ClientBench
+{
+  static constexpr auto kServerTick = 25ms;
+  static constexpr auto kSendRate = 100ms;
+  static constexpr auto kInputRate = 60ms;
+
+  struct InFlight
+  {
+    Clock::time_point arrival;
+    Clock::time_point sent;
+    std::vector<std::byte> bytes;
+  };
+
+  struct Input
+  {
+    Clock::time_point arrival;
+    glm::vec2 vel;
+  };
+
+ public:
+  explicit ClientBench(const BenchConfig& config)
+    : config_{config}
+  {
+    world_.reset(now_);
+    refill();
+  }
+
+  void run()
+  {
+    const auto frame = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<float>(1.f / config_.frameRate));
+    const auto end = now_ + std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<float>(config_.seconds));
+
+    while (now_ < end)
+    {
+      now_ += frame;
+      serverUntil(now_);
+
+      const auto clientStart = Clock::now();
+      clientFrame(durationToSecs(frame));
+      clientTime_ += Clock::now() - clientStart;
+      ++frames_;
+    }
+  }
+
+  void report() const
+  {
+    const float wallSecs = durationToSecs(clientTime_);
+    const auto& jitter = world_.jitter();
+    spdlog::info("{} frames in {:.3f} s of client time: {:.0f} frames/s, {:.1f} us/frame",
+      frames_, wallSecs, static_cast<float>(frames_) / wallSecs, wallSecs*1e6f / static_cast<float>(frames_));
+    spdlog::info("{} snapshots, interp delay {:.1f} ms (target {:.1f}), interval {:.1f} ms, jitter {:.1f} ms",
+      snapshots_, jitter.delayMs(), jitter.targetDelayMs(), jitter.intervalMs(), jitter.jitterMs());
+    spdlog::info("player prediction error vs server: mean {:.5f}, max {:.5f} over {} frames, {} respawns",
+      errorSamples_ > 0 ? errorSum_ / static_cast<float>(errorSamples_) : 0.f, errorMax_, errorSamples_, respawns_);
+  }
+
+ private:
+  // Left alone the world collapses into a single blob within seconds,
+  // keep the client's workload steady instead
+  void refill()
+  {
+    if (index_.find(state_, player_) == nullptr)
+    {
+      // Big enough to survive for a while, otherwise there's no prediction to measure
+      auto player = Entity::create();
+      player.size = 0.2f;
+      player_ = index_.insert(state_, player).id;
+      bots_.emplace_back();
+      world_.setPlayer(player_);
+      ++respawns_;
+    }
+
+    while (state_.size() < config_.entities + 1)
+    {
+      auto id = index_.insert(state_, Entity::create()).id;
+      bots_.emplace_back(BotState::wander(id));
+    }
+  }
+
+  Clock::duration linkDelay()
+  {
+    std::uniform_int_distribution<Clock::rep> distr(0, config_.jitter.count());
+    return config_.latency + Clock::duration{distr(rng_)};
+  }
+
+  void serverUntil(Clock::time_point time)
+  {
+    while (lastTick_ + kServerTick <= time)
+    {
+      lastTick_ += kServerTick;
+
+      while (!inputs_.empty() && inputs_.front().arrival <= lastTick_)
+      {
+        if (auto player = index_.find(state_, player_)) player->vel = inputs_.front().vel;
+        inputs_.pop_front();
+      }
+
+      simulation_.tick(state_, index_, bots_, durationToSecs(kServerTick), tick_++);
+      refill();
+
+      if (lastTick_ - lastSend_ >= kSendRate)
+      {
+        lastSend_ = lastTick_;
+
+        // Replication is sequenced, late packets never overtake
+        auto arrival = lastTick_ + linkDelay();
+        if (!inFlight_.empty())
+        {
+          arrival = std::max(arrival, inFlight_.back().arrival);
+        }
+
+        auto& packet = inFlight_.emplace_back(InFlight{
+            .arrival = arrival,
+            .sent = lastTick_,
+            .bytes = std::vector<std::byte>(state_.size()*sizeof(Entity)),
+          });
+        std::memcpy(packet.bytes.data(), state_.data(), packet.bytes.size());
+      }
+    }
+  }
+
+  void clientFrame(float delta)
+  {
+    while (!inFlight_.empty() && inFlight_.front().arrival <= now_)
+    {
+      const auto& packet = inFlight_.front();
+      // As if the clocks were perfectly synced
+      world_.onSnapshot({packet.bytes.data(), packet.bytes.size()}, now_, packet.sent);
+      inFlight_.pop_front();
+      ++snapshots_;
+    }
+
+    // Steer in circles, one lap every few seconds
+    const float angle = durationToSecs(now_.time_since_epoch()) * 1.5f;
+    world_.setInput(glm::vec2{std::cos(angle), std::sin(angle)} * 0.8f);
+
+    world_.update(now_, delta, 2*config_.latency + config_.jitter);
+
+    // Like the real client, only send input that differs from the last one sent
+    if (glm::length(world_.input() - lastSentInput_) > 1e-3 && now_ - lastInput_ > kInputRate)
+    {
+      lastInput_ = now_;
+      lastSentInput_ = world_.input();
+      inputs_.push_back(Input{ .arrival = now_ + linkDelay(), .vel = lastSentInput_ });
+    }
+
+    auto predicted = world_.entityById(player_);
+    auto actual = index_.find(state_, player_);
+    if (predicted != nullptr && actual != nullptr)
+    {
+      const float error = glm::length(predicted->pos - actual->pos);
+      errorSum_ += error;
+      errorMax_ = std::max(errorMax_, error);
+      ++errorSamples_;
+    }
+  }
+
+ private:
+  BenchConfig config_;
+  std::default_random_engine rng_;
+
+  // Simulated time, both sides share it
+  Clock::time_point now_{Clock::time_point{} + 1h};
+
+  JobSystem jobs_{0};
+  Simulation simulation_{jobs_};
+  GameState state_;
+  EntityIndex index_;
+  BotStates bots_;
+  id_t player_{kInvalidId};
+  uint64_t tick_{0};
+  Clock::time_point lastTick_{now_};
+  Clock::time_point lastSend_{now_};
+
+  std::deque<InFlight> inFlight_;
+  std::deque<Input> inputs_;
+  Clock::time_point lastInput_{now_};
+  glm::vec2 lastSentInput_{0, 0};
+
+  ClientWorld world_;
+
+  Clock::duration clientTime_{0};
+  uint64_t frames_{0};
+  uint64_t snapshots_{0};
+  float errorSum_{0};
+  float errorMax_{0};
+  uint64_t errorSamples_{0};
+  uint64_t respawns_{0};
+};
+
+int main(int argc, char** argv)
+{
+  if (argc > 6)
+  {
+    spdlog::error("Usage: {} [entities] [simulated seconds] [frame rate] [latency ms] [jitter ms]\n", argv[0]);
+    return -1;
+  }
+
+  auto arg =
+    [argc, argv](int i, float fallback)
+    {
+      return argc > i ? std::max(static_cast<float>(std::atof(argv[i])), 0.f) : fallback;
+    };
+  auto ms =
+    [](float value)
+    {
+      return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float, std::milli>(value));
+    };
+
+  const BenchConfig config{
+    .entities = static_cast<uint32_t>(arg(1, 1000)),
+    .seconds = arg(2, 60),
+    .frameRate = std::max(arg(3, 60), 1.f),
+    .latency = ms(arg(4, 30)),
+    .jitter = ms(arg(5, 20)),
+  };
+
+  spdlog::info("Simulating {} s at {} fps with {} entities", config.seconds, config.frameRate, config.entities);
+
+  ClientBench bench(config);
+  bench.run();
+  bench.report();
+
+  return 0;
+}
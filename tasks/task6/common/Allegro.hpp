@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <allegro5/allegro5.h>
 #include <allegro5/allegro_font.h>
 #include <allegro5/allegro_primitives.h>
@@ -15,6 +16,7 @@ class Allegro
  public:
   static constexpr int kWidth = 1280;
   static constexpr int kHeight = 720;
+  static constexpr auto kFrameInterval = std::chrono::microseconds{1'000'000 / 30};
 
   Allegro()
   {
@@ -26,7 +28,6 @@ class Allegro
     event_queue_ = {al_create_event_queue(), &al_destroy_event_queue};
     display_ = {al_create_display(kWidth, kHeight), &al_destroy_display};
     font_ = {al_create_builtin_font(), &al_destroy_font};
-    draw_timer_ = {al_create_timer(1.f/30.f), &al_destroy_timer};
 
     ImGui::CreateContext();
     ImGui::StyleColorsDark();
@@ -35,9 +36,6 @@ class Allegro
     al_register_event_source(event_queue_.get(), al_get_keyboard_event_source());
     al_register_event_source(event_queue_.get(), al_get_mouse_event_source());
     al_register_event_source(event_queue_.get(), al_get_display_event_source(display_.get()));
-    al_register_event_source(event_queue_.get(), al_get_timer_event_source(draw_timer_.get()));
-
-    al_start_timer(draw_timer_.get());
   }
 
   ~Allegro()
@@ -46,10 +44,10 @@ class Allegro
     ImGui::DestroyContext();
   }
 
+  // Allegro's queue can't be waited on together with sockets, so the
+  // owner calls this every frame instead, see kFrameInterval
   void poll()
   {
-    bool redraw = false;
-
     while (!al_event_queue_is_empty(event_queue_.get()))
     {
       ALLEGRO_EVENT event;
@@ -59,13 +57,6 @@ class Allegro
 
       switch(event.type)
       {
-        case ALLEGRO_EVENT_TIMER:
-          if (event.timer.source == draw_timer_.get())
-          {
-            redraw = true;
-          }
-          break;
-
         case ALLEGRO_EVENT_MOUSE_AXES:
           self().mouse(event.mouse.x, event.mouse.y);
           break;
@@ -83,20 +74,22 @@ class Allegro
           break;
       }
     }
-    
-    if (redraw)
-    {
-      ImGui_ImplAllegro5_NewFrame();
-      ImGui::NewFrame();
-      self().drawGui();
-      ImGui::Render();
+  }
 
+  void render()
+  {
+    if (display_ == nullptr) return;
 
-      al_clear_to_color(al_map_rgb(0, 0, 0));
-      self().draw();
-      ImGui_ImplAllegro5_RenderDrawData(ImGui::GetDrawData());
-      al_flip_display();
-    }
+    ImGui_ImplAllegro5_NewFrame();
+    ImGui::NewFrame();
+    self().drawGui();
+    ImGui::Render();
+
+
+    al_clear_to_color(al_map_rgb(0, 0, 0));
+    self().draw();
+    ImGui_ImplAllegro5_RenderDrawData(ImGui::GetDrawData());
+    al_flip_display();
   }
 
   void stop()
@@ -114,5 +107,4 @@ class Allegro
     UniquePtr<ALLEGRO_EVENT_QUEUE> event_queue_{nullptr, nullptr};
     UniquePtr<ALLEGRO_DISPLAY> display_{nullptr, nullptr};
     UniquePtr<ALLEGRO_FONT> font_{nullptr, nullptr};
-    UniquePtr<ALLEGRO_TIMER> draw_timer_{nullptr, nullptr};
 };
@@ -1,68 +1,135 @@
 #pragma once
 
-#include <iostream>
+#include <array>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef _WIN32
 #include <atomic>
+#include <iostream>
 #include <thread>
-#include <deque>
+#include "SpscQueue.hpp"
+#else
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 #include "assert.hpp"
 
 
-// NOTE: shutdown support is SHIT
+// Line based stdin for single threaded loops. On POSIX stdin is only read
+// when poll() says it won't block, and inputFd() lets the owner sleep on it
+// together with the network (Service does so automatically). The fd's flags
+// are left alone, as they are shared with the terminal and thus stdout.
+// Windows can't wait on a console together with sockets, so there a reader
+// thread feeds a lock-free queue instead and stop() waits for one last line.
 template<class Derived>
 class AsyncInput
 {
  public:
   AsyncInput()
-    : worker_{[this](){ Work(); }}
   {
+#ifdef _WIN32
+    worker_ = std::thread{[this](){ work(); }};
+#endif
+  }
+
+  ~AsyncInput()
+  {
+    stop();
   }
 
   void stop()
   {
-    stopped_.store(true, std::memory_order::relaxed);
+    if (std::exchange(stopped_, true)) return;
+
+#ifdef _WIN32
+    stopping_.store(true, std::memory_order::relaxed);
+    std::cout << "Press ENTER to exit..." << std::endl;
     worker_.join();
-  };
+#endif
+  }
+
+  // -1 if there is nothing to wait for
+  int inputFd() const
+  {
+#ifdef _WIN32
+    return -1;
+#else
+    return stopped_ || eof_ ? -1 : STDIN_FILENO;
+#endif
+  }
 
   void poll()
   {
-    std::deque<std::string> stolen;
+    if (stopped_) return;
+
+#ifdef _WIN32
+    std::string line;
+    while (lines_.pop(line))
     {
-      std::lock_guard lock{mtx_};
-      stolen = std::move(lines_);
+      self().handleLine(line);
     }
-    for (const auto& line : stolen)
+#else
+    pollfd stdinFd{ .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 };
+    while (!eof_ && ::poll(&stdinFd, 1, 0) > 0)
     {
-      self().handleLine(line);
+      std::array<char, 4096> chunk;
+      const ssize_t read = ::read(STDIN_FILENO, chunk.data(), chunk.size());
+      if (read > 0)
+      {
+        pending_.append(chunk.data(), static_cast<size_t>(read));
+      }
+      else if (read == 0 || errno != EINTR)
+      {
+        // Closed stdin stays readable forever, stop watching it
+        eof_ = true;
+      }
     }
-  }
 
-  ~AsyncInput()
-  {
-    NG_VERIFY(stopped_.load(std::memory_order::relaxed));
+    size_t start = 0;
+    for (size_t end; (end = pending_.find('\n', start)) != std::string::npos; start = end + 1)
+    {
+      std::string_view line{pending_.data() + start, end - start};
+      if (line.ends_with('\r')) line.remove_suffix(1);
+      self().handleLine(line);
+    }
+    pending_.erase(0, start);
+#endif
   }
 
  private:
   Derived& self() { return *static_cast<Derived*>(this); }
   const Derived& self() const { return *static_cast<const Derived*>(this); }
 
-  void Work()
+#ifdef _WIN32
+  void work()
   {
-    while (!stopped_.load(std::memory_order::relaxed))
+    while (!stopping_.load(std::memory_order::relaxed))
     {
-      std::string result;
-      std::getline(std::cin, result);
-      
-      std::lock_guard lock{mtx_};
-      lines_.emplace_back(std::move(result));
+      std::string line;
+      if (!std::getline(std::cin, line)) break;
+
+      while (!lines_.push(std::move(line)))
+      {
+        std::this_thread::yield();
+      }
     }
   }
+#endif
 
  private:
-  std::mutex mtx_;
-  std::deque<std::string> lines_;
-
+  bool stopped_{false};
 
+#ifdef _WIN32
+  SpscQueue<std::string, 64> lines_;
   std::thread worker_;
-  std::atomic<bool> stopped_{false};
+  std::atomic<bool> stopping_{false};
+#else
+  // Bytes after the last complete line
+  std::string pending_;
+  bool eof_{false};
+#endif
 };
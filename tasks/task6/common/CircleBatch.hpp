@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <vector>
+#include <allegro5/allegro5.h>
+#include <allegro5/allegro_primitives.h>
+
+
+// Collects filled circles into a single triangle list and submits it with
+// one al_draw_prim call. Circles outside of the viewport are dropped and
+// the rest get a segment count proportional to their on-screen size.
+class CircleBatch
+{
+ public:
+  // Longest allowed polygon edge in pixels
+  static constexpr float kMaxEdgePx = 4.f;
+  static constexpr int kMinSegments = 6;
+  static constexpr int kMaxSegments = 64;
+
+  void begin(float viewWidth, float viewHeight)
+  {
+    viewWidth_ = viewWidth;
+    viewHeight_ = viewHeight;
+    vertices_.clear();
+    submitted_ = 0;
+    drawn_ = 0;
+  }
+
+  void add(float x, float y, float radius, ALLEGRO_COLOR color)
+  {
+    ++submitted_;
+
+    if (x + radius < 0 || x - radius > viewWidth_
+      || y + radius < 0 || y - radius > viewHeight_
+      || radius < 0.5f)
+    {
+      return;
+    }
+
+    ++drawn_;
+
+    const int segments = std::clamp(
+      static_cast<int>(std::ceil(2*std::numbers::pi_v<float>*radius / kMaxEdgePx)),
+      kMinSegments, kMaxSegments);
+
+    // Rotate a unit vector instead of calling sin/cos per vertex
+    const float step = 2*std::numbers::pi_v<float> / static_cast<float>(segments);
+    const float cosStep = std::cos(step);
+    const float sinStep = std::sin(step);
+
+    float dx = radius;
+    float dy = 0;
+    for (int i = 0; i < segments; ++i)
+    {
+      const float nextDx = dx*cosStep - dy*sinStep;
+      const float nextDy = dx*sinStep + dy*cosStep;
+
+      vertices_.push_back(vertex(x, y, color));
+      vertices_.push_back(vertex(x + dx, y + dy, color));
+      vertices_.push_back(vertex(x + nextDx, y + nextDy, color));
+
+      dx = nextDx;
+      dy = nextDy;
+    }
+  }
+
+  void flush()
+  {
+    if (vertices_.empty()) return;
+
+    al_draw_prim(vertices_.data(), nullptr, nullptr,
+      0, static_cast<int>(vertices_.size()), ALLEGRO_PRIM_TRIANGLE_LIST);
+  }
+
+  size_t submitted() const { return submitted_; }
+  size_t drawn() const { return drawn_; }
+  size_t triangles() const { return vertices_.size() / 3; }
+
+ private:
+  static ALLEGRO_VERTEX vertex(float x, float y, ALLEGRO_COLOR color)
+  {
+    return ALLEGRO_VERTEX{ .x = x, .y = y, .z = 0, .u = 0, .v = 0, .color = color };
+  }
+
+ private:
+  float viewWidth_{0};
+  float viewHeight_{0};
+
+  // Kept between frames, so steady-state drawing doesn't allocate
+  std::vector<ALLEGRO_VERTEX> vertices_;
+  size_t submitted_{0};
+  size_t drawn_{0};
+};
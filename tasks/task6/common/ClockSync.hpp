@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+#include "Service.hpp"
+#include "RingBuffer.hpp"
+
+
+// Time points travel as microseconds since the sender's steady_clock epoch,
+// which is different on every machine, hence all of the below.
+inline int64_t toWireTime(std::chrono::steady_clock::time_point time)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+inline std::chrono::steady_clock::time_point fromWireTime(int64_t us)
+{
+  return std::chrono::steady_clock::time_point{
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds{us})};
+}
+
+// Estimates remote = local + offset + drift*(local - ref) from NTP-style
+// ping samples. Samples that sat in a queue somewhere (RTT well above the
+// best one seen) are ignored, the rest get a least squares line once they
+// span long enough for the slope to mean anything.
+class RemoteClock
+{
+ public:
+  static constexpr int64_t kMinDriftSpanUs = 2'000'000;
+  static constexpr int64_t kRttToleranceUs = 1'000;
+  // Quartz is good to a few dozen ppm, anything above is noise
+  static constexpr double kMaxDrift = 500e-6;
+
+  // All times in microseconds, sent and received are local
+  void addSample(int64_t sent, int64_t remote, int64_t received)
+  {
+    const int64_t rtt = received - sent;
+    if (rtt < 0) return;
+
+    const int64_t local = sent + rtt/2;
+    samples_.pushBack(Sample{ .local = local, .offset = remote - local, .rtt = rtt });
+    fit();
+  }
+
+  bool synced() const { return !samples_.empty(); }
+
+  int64_t toLocal(int64_t remote) const
+  {
+    const double x = static_cast<double>(remote - ref_) - offset_;
+    return ref_ + static_cast<int64_t>(x / (1 + drift_));
+  }
+
+  int64_t toRemote(int64_t local) const
+  {
+    return local + static_cast<int64_t>(offset_ + drift_*static_cast<double>(local - ref_));
+  }
+
+  double offsetUs() const { return offset_; }
+  double drift() const { return drift_; }
+  int64_t bestRttUs() const { return bestRtt_; }
+
+ private:
+  struct Sample
+  {
+    int64_t local;
+    int64_t offset;
+    int64_t rtt;
+  };
+
+  void fit()
+  {
+    bestRtt_ = samples_.front().rtt;
+    size_t best = 0;
+    for (size_t i = 1; i < samples_.size(); ++i)
+    {
+      if (samples_[i].rtt < bestRtt_)
+      {
+        bestRtt_ = samples_[i].rtt;
+        best = i;
+      }
+    }
+
+    const int64_t maxRtt = bestRtt_ + std::max(bestRtt_/2, kRttToleranceUs);
+
+    // Relative to the best sample to keep the doubles small
+    const int64_t base = samples_[best].local;
+    const int64_t baseOffset = samples_[best].offset;
+
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int64_t first = base, last = base;
+    for (size_t i = 0; i < samples_.size(); ++i)
+    {
+      const auto& s = samples_[i];
+      if (s.rtt > maxRtt) continue;
+
+      const double x = static_cast<double>(s.local - base);
+      const double y = static_cast<double>(s.offset - baseOffset);
+      n += 1; sx += x; sy += y; sxx += x*x; sxy += x*y;
+      first = std::min(first, s.local);
+      last = std::max(last, s.local);
+    }
+
+    const double denominator = n*sxx - sx*sx;
+    if (last - first < kMinDriftSpanUs || denominator <= 0)
+    {
+      ref_ = base;
+      offset_ = static_cast<double>(baseOffset);
+      drift_ = 0;
+      return;
+    }
+
+    drift_ = std::clamp((n*sxy - sx*sy) / denominator, -kMaxDrift, kMaxDrift);
+    const int64_t center = static_cast<int64_t>(sx / n);
+    ref_ = base + center;
+    offset_ = static_cast<double>(baseOffset) + (sy - drift_*sx) / n + drift_*static_cast<double>(center);
+  }
+
+ private:
+  RingBuffer<Sample, 32> samples_;
+
+  int64_t ref_{0};
+  double offset_{0};
+  double drift_{0};
+  int64_t bestRtt_{0};
+};
+
+// Answers time requests from anyone, and keeps a RemoteClock for each
+// peer it was asked to sync with. Derived has to pull in handlePacket
+// and call updateClockSync regularly on the syncing side.
+template<class Derived>
+class ClockSync
+{
+  using Clock = std::chrono::steady_clock;
+
+  struct SyncData
+  {
+    RemoteClock clock;
+    Clock::time_point nextPing;
+    size_t pingsSent{0};
+  };
+
+  Derived& self() { return *static_cast<Derived*>(this); }
+
+ public:
+  // A quick burst for the initial estimate, then a trickle for drift
+  static constexpr size_t kBurstPings = 8;
+  static constexpr auto kBurstInterval = std::chrono::milliseconds{100};
+  static constexpr auto kPingInterval = std::chrono::seconds{1};
+
+  void handlePacket(ENetPeer* peer, enet_uint8 chan, const PTimeRequest& packet)
+  {
+    self().send(peer, chan, {}, PTimeResponse{
+        .requestTime = packet.requestTime,
+        .responseTime = toWireTime(Clock::now()),
+      });
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PTimeResponse& packet)
+  {
+    auto it = clocks_.find(peer);
+    if (it == clocks_.end()) return;
+
+    it->second.clock.addSample(packet.requestTime, packet.responseTime, toWireTime(Clock::now()));
+  }
+
+  void startClockSync(ENetPeer* peer, enet_uint8 channel)
+  {
+    clocks_.emplace(peer, SyncData{ .nextPing = Clock::now() });
+    channel_ = channel;
+  }
+
+  void stopClockSync(ENetPeer* peer)
+  {
+    clocks_.erase(peer);
+  }
+
+  void updateClockSync(Clock::time_point now)
+  {
+    for (auto&[peer, data] : clocks_)
+    {
+      if (now < data.nextPing) continue;
+
+      self().send(peer, channel_, {}, PTimeRequest{ .requestTime = toWireTime(now) });
+      data.nextPing = now + (++data.pingsSent < kBurstPings ? kBurstInterval : kPingInterval);
+    }
+  }
+
+  // nullptr until we got at least one answer
+  const RemoteClock* remoteClock(ENetPeer* peer) const
+  {
+    auto it = clocks_.find(peer);
+    if (it == clocks_.end() || !it->second.clock.synced()) return nullptr;
+    return &it->second.clock;
+  }
+
+ private:
+  std::unordered_map<ENetPeer*, SyncData> clocks_;
+  enet_uint8 channel_{0};
+};
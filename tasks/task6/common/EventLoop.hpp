@@ -0,0 +1,205 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <enet/enet.h>
+#include <function2/function2.hpp>
+
+#ifndef _WIN32
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "assert.hpp"
+
+
+// Sleeps until a watched fd is readable or a timer is due and runs the
+// matching callbacks, so a loop built on it only wakes up when there is
+// work. On Linux everything, timers included, is an fd in one epoll set.
+// Windows has no such thing for sockets and consoles together, there the
+// loop sleeps on the first watched socket until the next timer and then
+// runs every fd callback, which have to cope with having nothing to read.
+class EventLoop
+{
+  using Clock = std::chrono::steady_clock;
+  using Callback = fu2::unique_function<void()>;
+
+ public:
+  EventLoop()
+  {
+#ifndef _WIN32
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    NG_VERIFY(epoll_ != -1);
+#endif
+  }
+
+  ~EventLoop()
+  {
+#ifndef _WIN32
+    for (auto& timer : timers_)
+    {
+      close(timer.fd);
+    }
+    close(epoll_);
+#endif
+  }
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // False if the fd can't be waited on, epoll refuses regular files and
+  // /dev/null with EPERM. Those never block, callers can just read them.
+  [[nodiscard]] bool watch(int fd, Callback f)
+  {
+    NG_ASSERT(fd != -1);
+#ifndef _WIN32
+    epoll_event event{ .events = EPOLLIN, .data = { .u64 = static_cast<uint64_t>(fd) } };
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) return false;
+#endif
+    watched_[fd] = std::move(f);
+    return true;
+  }
+
+  // Safe to call from inside the fd's own callback
+  void unwatch(int fd)
+  {
+    if (watched_.erase(fd) == 0) return;
+#ifndef _WIN32
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+  }
+
+  // Runs f every period, the first time one period from now. Late wakeups
+  // don't accumulate: missed ticks are run once, not caught up on.
+  void every(Clock::duration period, Callback f)
+  {
+    auto& timer = timers_.emplace_back(Timer{
+        .period = period,
+        .next = Clock::now() + period,
+        .f = std::move(f),
+      });
+#ifndef _WIN32
+    timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    NG_VERIFY(timer.fd != -1);
+
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+    const timespec spec{ .tv_sec = ns / 1'000'000'000, .tv_nsec = ns % 1'000'000'000 };
+    const itimerspec interval{ .it_interval = spec, .it_value = spec };
+    NG_VERIFY(timerfd_settime(timer.fd, 0, &interval, nullptr) == 0);
+
+    // Tagged with the timer's index, fds are never that large
+    epoll_event event{ .events = EPOLLIN, .data = { .u64 = kTimerTag | (timers_.size() - 1) } };
+    NG_VERIFY(epoll_ctl(epoll_, EPOLL_CTL_ADD, timer.fd, &event) == 0);
+#endif
+  }
+
+  void run()
+  {
+    stopped_ = false;
+    while (!stopped_)
+    {
+      runOnce();
+    }
+  }
+
+  void stop() { stopped_ = true; }
+
+  // Waits for at least one event and dispatches everything that is ready
+  void runOnce()
+  {
+#ifndef _WIN32
+    std::array<epoll_event, 16> events;
+    int count = epoll_wait(epoll_, events.data(), static_cast<int>(events.size()), -1);
+    if (count < 0)
+    {
+      NG_VERIFY(errno == EINTR);
+      return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+      const auto data = events[i].data.u64;
+      if (data & kTimerTag)
+      {
+        auto& timer = timers_[data & ~kTimerTag];
+        uint64_t expirations;
+        if (read(timer.fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+          timer.f();
+        }
+      }
+      else if (auto it = watched_.find(static_cast<int>(data)); it != watched_.end())
+      {
+        // Moved out so that the callback may unwatch itself
+        auto f = std::move(it->second);
+        f();
+        if (auto back = watched_.find(static_cast<int>(data)); back != watched_.end() && !back->second)
+        {
+          back->second = std::move(f);
+        }
+      }
+    }
+#else
+    auto now = Clock::now();
+    auto next = now + std::chrono::seconds{1};
+    for (auto& timer : timers_)
+    {
+      next = std::min(next, timer.next);
+    }
+
+    if (next > now && !watched_.empty())
+    {
+      enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+      const auto ms = std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+      enet_socket_wait(static_cast<ENetSocket>(watched_.begin()->first), &condition, static_cast<enet_uint32>(ms));
+    }
+
+    std::vector<int> fds;
+    for (auto& [fd, f] : watched_) fds.push_back(fd);
+    for (int fd : fds)
+    {
+      if (auto it = watched_.find(fd); it != watched_.end())
+      {
+        auto f = std::move(it->second);
+        f();
+        if (auto back = watched_.find(fd); back != watched_.end() && !back->second)
+        {
+          back->second = std::move(f);
+        }
+      }
+    }
+
+    now = Clock::now();
+    for (auto& timer : timers_)
+    {
+      if (timer.next <= now)
+      {
+        timer.next = std::max(timer.next + timer.period, now);
+        timer.f();
+      }
+    }
+#endif
+  }
+
+ private:
+  struct Timer
+  {
+    Clock::duration period;
+    Clock::time_point next;
+    Callback f;
+    int fd{-1};
+  };
+
+  static constexpr uint64_t kTimerTag = uint64_t{1} << 63;
+
+ private:
+  std::unordered_map<int, Callback> watched_;
+  std::vector<Timer> timers_;
+  bool stopped_{false};
+#ifndef _WIN32
+  int epoll_{-1};
+#endif
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <optional>
+
+
+// Watches when snapshots arrive versus when they were sent and derives how
+// far behind the newest snapshot rendering has to stay so that it rarely
+// runs out of data: the transit time, a bit more than one send interval and
+// a few mean deviations of the transit time (RFC 3550 style jitter).
+// The actual delay chases the target gradually, so playback only speeds up
+// or slows down a little instead of jumping back and forth in time.
+class JitterEstimator
+{
+  using Clock = std::chrono::steady_clock;
+  using Ms = std::chrono::duration<float, std::milli>;
+
+ public:
+  static constexpr float kDelayIntervals = 1.5f;
+  static constexpr float kDelayJitters = 3.f;
+  static constexpr float kMinDelayMs = 20.f;
+  static constexpr float kMaxDelayMs = 1000.f;
+  // Delay change per unit of real time: growing is urgent, shrinking is not
+  static constexpr float kGrowRate = 0.5f;
+  static constexpr float kShrinkRate = 0.05f;
+
+  explicit JitterEstimator(float expectedIntervalMs)
+    : intervalMs_{expectedIntervalMs}
+    , delayMs_{targetDelayMs()}
+  {
+  }
+
+  // sent is on our timeline, pass arrival itself if the sender's clock is unknown
+  void onArrival(Clock::time_point arrival, Clock::time_point sent)
+  {
+    const float transit = Ms(arrival - sent).count();
+
+    if (last_.has_value())
+    {
+      // Long stalls (reconnects, breakpoints) would poison the averages
+      const float interval = std::min(Ms(sent - last_->sent).count(), kMaxDelayMs);
+      const float arrivalInterval = std::min(Ms(arrival - last_->arrival).count(), kMaxDelayMs);
+
+      intervalMs_ += (interval - intervalMs_) / 8.f;
+      transitMs_ += (transit - transitMs_) / 8.f;
+      jitterMs_ += (std::abs(arrivalInterval - interval) - jitterMs_) / 16.f;
+    }
+    else
+    {
+      transitMs_ = transit;
+    }
+    last_ = {arrival, sent};
+  }
+
+  // Forget the last arrival, e.g. when switching servers
+  void restart()
+  {
+    last_.reset();
+  }
+
+  // Moves the delay towards the target and returns it
+  Clock::duration update(Clock::duration elapsed)
+  {
+    const float elapsedMs = Ms(elapsed).count();
+    const float diff = targetDelayMs() - delayMs_;
+
+    delayMs_ += diff > 0
+      ? std::min(diff, elapsedMs*kGrowRate)
+      : std::max(diff, -elapsedMs*kShrinkRate);
+
+    return delay();
+  }
+
+  Clock::duration delay() const
+  {
+    return std::chrono::duration_cast<Clock::duration>(Ms(delayMs_));
+  }
+
+  float targetDelayMs() const
+  {
+    return std::clamp(transitMs_ + intervalMs_*kDelayIntervals + jitterMs_*kDelayJitters,
+      kMinDelayMs, kMaxDelayMs);
+  }
+
+  float intervalMs() const { return intervalMs_; }
+  float jitterMs() const { return jitterMs_; }
+  float transitMs() const { return transitMs_; }
+  float delayMs() const { return delayMs_; }
+
+ private:
+  struct Arrival
+  {
+    Clock::time_point arrival;
+    Clock::time_point sent;
+  };
+
+  std::optional<Arrival> last_;
+  float intervalMs_;
+  float transitMs_{0};
+  float jitterMs_{0};
+  float delayMs_;
+};
@@ -0,0 +1,136 @@
+#include "JobSystem.hpp"
+
+
+namespace
+{
+
+thread_local const JobSystem* tlsOwner = nullptr;
+thread_local size_t tlsQueue = 0;
+
+}
+
+JobSystem::JobSystem(size_t workerCount)
+{
+  queues_.reserve(workerCount);
+  for (size_t i = 0; i < workerCount; ++i)
+  {
+    queues_.emplace_back(std::make_unique<Queue>());
+  }
+
+  workers_.reserve(workerCount);
+  for (size_t i = 0; i < workerCount; ++i)
+  {
+    workers_.emplace_back([this, i]() { work(i); });
+  }
+}
+
+JobSystem::~JobSystem()
+{
+  {
+    std::lock_guard lock{sleepMtx_};
+    stopped_.store(true, std::memory_order::relaxed);
+  }
+  wake_.notify_all();
+
+  for (auto& worker : workers_)
+  {
+    worker.join();
+  }
+}
+
+size_t JobSystem::currentQueue() const
+{
+  return tlsOwner == this ? tlsQueue : queues_.size();
+}
+
+void JobSystem::push(Job job)
+{
+  NG_ASSERT(!queues_.empty());
+
+  size_t index = currentQueue();
+  if (index == queues_.size())
+  {
+    index = nextQueue_.fetch_add(1, std::memory_order::relaxed) % queues_.size();
+  }
+
+  // Counted before it becomes visible, otherwise a thief could take it and
+  // decrement first, wrapping queued_ around and keeping every worker awake
+  queued_.fetch_add(1, std::memory_order::relaxed);
+
+  auto& queue = *queues_[index];
+  {
+    std::lock_guard lock{queue.mtx};
+    queue.jobs.emplace_back(std::move(job));
+  }
+}
+
+void JobSystem::wakeWorkers()
+{
+  {
+    // Makes sure nobody is between checking queued_ and going to sleep
+    std::lock_guard lock{sleepMtx_};
+  }
+  wake_.notify_all();
+}
+
+bool JobSystem::runOne()
+{
+  const size_t self = currentQueue();
+  const size_t count = queues_.size();
+
+  Job job;
+
+  auto tryTake =
+    [&job](Queue& queue, bool own)
+    {
+      std::lock_guard lock{queue.mtx};
+      if (queue.jobs.empty()) return false;
+
+      if (own)
+      {
+        job = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+      }
+      else
+      {
+        job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+      }
+      return true;
+    };
+
+  bool found = self < count && tryTake(*queues_[self], true);
+
+  const size_t start = self < count ? self + 1 : 0;
+  for (size_t i = 0; i < count && !found; ++i)
+  {
+    const size_t victim = (start + i) % count;
+    if (victim == self) continue;
+    found = tryTake(*queues_[victim], false);
+  }
+
+  if (!found) return false;
+
+  queued_.fetch_sub(1, std::memory_order::relaxed);
+  job();
+  return true;
+}
+
+void JobSystem::work(size_t index)
+{
+  tlsOwner = this;
+  tlsQueue = index;
+
+  while (!stopped_.load(std::memory_order::relaxed))
+  {
+    if (runOne()) continue;
+
+    std::unique_lock lock{sleepMtx_};
+    wake_.wait(lock,
+      [this]()
+      {
+        return stopped_.load(std::memory_order::relaxed)
+          || queued_.load(std::memory_order::acquire) > 0;
+      });
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <function2/function2.hpp>
+
+#include "assert.hpp"
+
+
+// Small work-stealing thread pool. Every worker owns a deque, pops its own
+// jobs from the back and steals from the front of other deques when idle.
+// A pool with 0 workers runs everything inline on the calling thread in
+// chunk order, which is what serial reference modes are built on.
+class JobSystem
+{
+ public:
+  using Job = fu2::unique_function<void()>;
+
+  explicit JobSystem(size_t workerCount);
+  ~JobSystem();
+
+  JobSystem(const JobSystem&) = delete;
+  JobSystem& operator=(const JobSystem&) = delete;
+
+  size_t workerCount() const { return workers_.size(); }
+
+  // Calls f(begin, end) for consecutive chunks of [0, count) of at most
+  // grain elements and blocks until all of them are done.
+  // The calling thread executes jobs too while waiting, so nesting is fine.
+  template<class F>
+  void parallelFor(size_t count, size_t grain, F&& f)
+  {
+    if (count == 0) return;
+
+    grain = std::max<size_t>(grain, 1);
+    const size_t chunks = (count + grain - 1) / grain;
+
+    if (workers_.empty() || chunks == 1)
+    {
+      for (size_t begin = 0; begin < count; begin += grain)
+      {
+        f(begin, std::min(begin + grain, count));
+      }
+      return;
+    }
+
+    std::atomic<size_t> remaining{chunks};
+    for (size_t begin = 0; begin < count; begin += grain)
+    {
+      push(
+        [&f, &remaining, begin, end = std::min(begin + grain, count)]()
+        {
+          f(begin, end);
+          remaining.fetch_sub(1, std::memory_order::release);
+        });
+    }
+    wakeWorkers();
+
+    while (remaining.load(std::memory_order::acquire) != 0)
+    {
+      if (!runOne())
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  struct Queue
+  {
+    std::mutex mtx;
+    std::deque<Job> jobs;
+  };
+
+  void push(Job job);
+  void wakeWorkers();
+  bool runOne();
+  void work(size_t index);
+
+  size_t currentQueue() const;
+
+ private:
+  // One queue per worker, external submitters spread jobs round-robin
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> nextQueue_{0};
+  std::atomic<bool> stopped_{false};
+
+  std::mutex sleepMtx_;
+  std::condition_variable wake_;
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "assert.hpp"
+#include "proto.hpp"
+
+
+// Lobby ids kept sorted in every LobbySort order, so a page is a slice of
+// one of them and a name prefix is a contiguous range of the name order.
+// Sorted vectors rather than trees: pages are read far more often than
+// lobbies change, and reading one needs random access for the offset.
+class LobbyIndex
+{
+ public:
+  static constexpr uint32_t kMaxPageSize = 50;
+
+  // The order pages are served in, clients use it to lay out theirs
+  static bool before(LobbySort sort, const LobbyEntry& a, const LobbyEntry& b)
+  {
+    switch (sort)
+    {
+    case LobbySort::Name:
+      return NameKey{a.name.data(), a.id} < NameKey{b.name.data(), b.id};
+    case LobbySort::Players:
+      return PlayersLess{}(PlayersKey{a.playerCount, a.id}, PlayersKey{b.playerCount, b.id});
+    case LobbySort::Newest:
+    default:
+      return a.id > b.id;
+    }
+  }
+
+  static std::string_view prefixOf(const LobbyQuery& query)
+  {
+    return {query.namePrefix.data(), strnlen(query.namePrefix.data(), query.namePrefix.size())};
+  }
+
+  size_t size() const { return newest_.size(); }
+
+  void insert(uint32_t id, std::string_view name, uint32_t playerCount)
+  {
+    NG_ASSERT(!playerCounts_.contains(id));
+    playerCounts_.emplace(id, playerCount);
+    insertSorted(newest_, id, std::greater{});
+    insertSorted(byName_, NameKey{std::string{name}, id}, std::less{});
+    insertSorted(byPlayers_, PlayersKey{playerCount, id}, PlayersLess{});
+  }
+
+  void erase(uint32_t id, std::string_view name)
+  {
+    auto it = playerCounts_.find(id);
+    NG_ASSERT(it != playerCounts_.end());
+    eraseSorted(newest_, id, std::greater{});
+    eraseSorted(byName_, NameKey{std::string{name}, id}, std::less{});
+    eraseSorted(byPlayers_, PlayersKey{it->second, id}, PlayersLess{});
+    playerCounts_.erase(it);
+  }
+
+  void setPlayerCount(uint32_t id, uint32_t playerCount)
+  {
+    auto& current = playerCounts_.at(id);
+    if (current == playerCount) return;
+
+    eraseSorted(byPlayers_, PlayersKey{current, id}, PlayersLess{});
+    current = playerCount;
+    insertSorted(byPlayers_, PlayersKey{current, id}, PlayersLess{});
+  }
+
+  // Fills page with the ids of the requested slice in query order and
+  // returns how many lobbies match the filter overall. The limit is taken
+  // as is, capping what clients ask for is up to the caller.
+  uint32_t query(const LobbyQuery& query, std::vector<uint32_t>& page) const
+  {
+    page.clear();
+    const size_t limit = query.limit;
+    const auto prefix = prefixOf(query);
+
+    if (prefix.empty())
+    {
+      switch (query.sort)
+      {
+      case LobbySort::Name:
+        slice(byName_.begin(), byName_.end(), query.offset, limit, page);
+        break;
+      case LobbySort::Players:
+        slice(byPlayers_.begin(), byPlayers_.end(), query.offset, limit, page);
+        break;
+      case LobbySort::Newest:
+      default:
+        slice(newest_.begin(), newest_.end(), query.offset, limit, page);
+        break;
+      }
+      return static_cast<uint32_t>(newest_.size());
+    }
+
+    auto first = std::lower_bound(byName_.begin(), byName_.end(), NameKey{std::string{prefix}, 0});
+    auto last = std::partition_point(first, byName_.end(),
+      [prefix](const NameKey& key) { return key.first.starts_with(prefix); });
+    const auto total = static_cast<uint32_t>(last - first);
+
+    if (query.sort == LobbySort::Name)
+    {
+      slice(first, last, query.offset, limit, page);
+      return total;
+    }
+
+    // Only the matches get sorted, and only as far as the page reaches
+    std::vector<PlayersKey> matches;
+    matches.reserve(total);
+    for (auto it = first; it != last; ++it)
+    {
+      matches.emplace_back(playerCounts_.at(it->second), it->second);
+    }
+
+    const size_t begin = std::min<size_t>(query.offset, matches.size());
+    const size_t end = std::min(begin + limit, matches.size());
+    auto order =
+      [sort = query.sort](const PlayersKey& a, const PlayersKey& b)
+      {
+        return sort == LobbySort::Players ? PlayersLess{}(a, b) : a.second > b.second;
+      };
+    std::partial_sort(matches.begin(), matches.begin() + static_cast<ptrdiff_t>(end), matches.end(), order);
+
+    for (size_t i = begin; i < end; ++i)
+    {
+      page.push_back(matches[i].second);
+    }
+    return total;
+  }
+
+ private:
+  using NameKey = std::pair<std::string, uint32_t>;
+  // Player count first, then id
+  using PlayersKey = std::pair<uint32_t, uint32_t>;
+
+  // Fullest first, oldest first among equals
+  struct PlayersLess
+  {
+    bool operator()(const PlayersKey& a, const PlayersKey& b) const
+    {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+  };
+
+  template<class T, class Less>
+  static void insertSorted(std::vector<T>& sorted, T value, Less less)
+  {
+    sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), value, less), std::move(value));
+  }
+
+  template<class T, class Less>
+  static void eraseSorted(std::vector<T>& sorted, const T& value, Less less)
+  {
+    auto it = std::lower_bound(sorted.begin(), sorted.end(), value, less);
+    NG_ASSERT(it != sorted.end() && *it == value);
+    sorted.erase(it);
+  }
+
+  static uint32_t idOf(uint32_t id) { return id; }
+  template<class Key>
+  static uint32_t idOf(const std::pair<Key, uint32_t>& key) { return key.second; }
+
+  template<class It>
+  static void slice(It first, It last, uint32_t offset, size_t limit, std::vector<uint32_t>& page)
+  {
+    auto begin = first + static_cast<ptrdiff_t>(std::min<size_t>(offset, static_cast<size_t>(last - first)));
+    auto end = begin + static_cast<ptrdiff_t>(std::min(limit, static_cast<size_t>(last - begin)));
+    for (auto it = begin; it != end; ++it)
+    {
+      page.push_back(idOf(*it));
+    }
+  }
+
+ private:
+  std::unordered_map<uint32_t, uint32_t> playerCounts_;
+
+  std::vector<uint32_t> newest_;
+  std::vector<NameKey> byName_;
+  std::vector<PlayersKey> byPlayers_;
+};
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <enet/enet.h>
+
+#include "assert.hpp"
+
+
+// Players waiting for an automatic match, bucketed by RTT to the lobby and
+// the bot count they asked for. Each bucket is a FIFO linked through the
+// tickets, and two ordered sets track which buckets can form a match: the
+// full ones, and all of them by how long their first player has waited.
+// Joining and leaving are O(1) plus a set update, forming a match is
+// O(log n) plus the players taken.
+class MatchmakingQueue
+{
+  using Clock = std::chrono::steady_clock;
+ public:
+  static constexpr uint32_t kMatchPlayers = 8;
+  // After this long the oldest player of a bucket gets a match with
+  // whoever is there, bots make up for the rest
+  static constexpr auto kMaxWait = std::chrono::seconds(5);
+  // Upper bounds of the RTT buckets, the last one is unbounded
+  static constexpr std::array<uint32_t, 3> kRttBucketsMs{50, 100, 200};
+
+  struct WaitReport
+  {
+    size_t matchedPlayers;
+    size_t waitingPlayers;
+    float p50Ms;
+    float p90Ms;
+    float p99Ms;
+    float maxMs;
+  };
+
+  static uint32_t rttBucket(uint32_t rttMs)
+  {
+    return static_cast<uint32_t>(
+      std::upper_bound(kRttBucketsMs.begin(), kRttBucketsMs.end(), rttMs) - kRttBucketsMs.begin());
+  }
+
+  size_t size() const { return tickets_.size(); }
+  bool contains(ENetPeer* peer) const { return tickets_.contains(peer); }
+
+  // Re-entering puts the player at the back of its new bucket
+  void enqueue(ENetPeer* peer, uint32_t rttMs, uint32_t botCount, Clock::time_point now)
+  {
+    remove(peer);
+
+    const Key key = (static_cast<Key>(rttBucket(rttMs)) << 32) | botCount;
+    auto& ticket = tickets_.emplace(peer, Ticket{ .peer = peer, .key = key, .since = now }).first->second;
+    auto& bucket = buckets_[key];
+
+    ticket.prev = bucket.tail;
+    if (bucket.tail != nullptr)
+    {
+      bucket.tail->next = &ticket;
+    }
+    else
+    {
+      bucket.head = &ticket;
+      heads_.emplace(now, key);
+    }
+    bucket.tail = &ticket;
+
+    if (++bucket.size == kMatchPlayers)
+    {
+      full_.insert(key);
+    }
+  }
+
+  // Returns how long the player had been waiting
+  std::optional<Clock::duration> remove(ENetPeer* peer, Clock::time_point now = Clock::now())
+  {
+    auto it = tickets_.find(peer);
+    if (it == tickets_.end()) return std::nullopt;
+
+    auto& ticket = it->second;
+    auto bucket = buckets_.find(ticket.key);
+    NG_ASSERT(bucket != buckets_.end());
+
+    if (ticket.prev != nullptr)
+    {
+      ticket.prev->next = ticket.next;
+    }
+    else
+    {
+      heads_.erase({ticket.since, ticket.key});
+      bucket->second.head = ticket.next;
+      if (ticket.next != nullptr)
+      {
+        heads_.emplace(ticket.next->since, ticket.key);
+      }
+    }
+    if (ticket.next != nullptr)
+    {
+      ticket.next->prev = ticket.prev;
+    }
+    else
+    {
+      bucket->second.tail = ticket.prev;
+    }
+
+    if (bucket->second.size-- == kMatchPlayers)
+    {
+      full_.erase(ticket.key);
+    }
+    if (bucket->second.size == 0)
+    {
+      buckets_.erase(bucket);
+    }
+
+    const auto waited = now - ticket.since;
+    tickets_.erase(it);
+    return waited;
+  }
+
+  // Calls onMatch(botCount, players) for every match that can be formed:
+  // full buckets first, then buckets whose oldest player ran out of patience.
+  // botCount is what the bucket asked for plus one per missing player.
+  template<class F>
+  void formMatches(Clock::time_point now, F&& onMatch)
+  {
+    while (!full_.empty())
+    {
+      formMatch(*full_.begin(), now, onMatch);
+    }
+
+    while (!heads_.empty() && now - heads_.begin()->first >= kMaxWait)
+    {
+      formMatch(heads_.begin()->second, now, onMatch);
+    }
+  }
+
+  // Wait times of everyone matched since the previous report
+  WaitReport report()
+  {
+    auto percentile =
+      [this](float p)
+      {
+        if (waitsMs_.empty()) return 0.f;
+
+        auto nth = waitsMs_.begin() + static_cast<ptrdiff_t>(p*static_cast<float>(waitsMs_.size() - 1));
+        std::nth_element(waitsMs_.begin(), nth, waitsMs_.end());
+        return *nth;
+      };
+
+    WaitReport report{
+      .matchedPlayers = waitsMs_.size(),
+      .waitingPlayers = tickets_.size(),
+      .p50Ms = percentile(0.5f),
+      .p90Ms = percentile(0.9f),
+      .p99Ms = percentile(0.99f),
+      .maxMs = percentile(1.f),
+    };
+    waitsMs_.clear();
+    return report;
+  }
+
+ private:
+  // RTT bucket in the high half, bot count in the low one
+  using Key = uint64_t;
+
+  struct Ticket
+  {
+    ENetPeer* peer;
+    Key key;
+    Clock::time_point since;
+    Ticket* prev{nullptr};
+    Ticket* next{nullptr};
+  };
+
+  struct Bucket
+  {
+    Ticket* head{nullptr};
+    Ticket* tail{nullptr};
+    uint32_t size{0};
+  };
+
+  template<class F>
+  void formMatch(Key key, Clock::time_point now, F& onMatch)
+  {
+    auto bucket = buckets_.find(key);
+    NG_ASSERT(bucket != buckets_.end());
+
+    players_.clear();
+    for (Ticket* ticket = bucket->second.head; ticket != nullptr && players_.size() < kMatchPlayers; ticket = ticket->next)
+    {
+      players_.push_back(ticket->peer);
+    }
+
+    // Removing the last one may free the bucket
+    for (auto peer : players_)
+    {
+      waitsMs_.push_back(std::chrono::duration<float, std::milli>(*remove(peer, now)).count());
+    }
+
+    const auto requestedBots = static_cast<uint32_t>(key & 0xFFFFFFFF);
+    const auto missingPlayers = kMatchPlayers - static_cast<uint32_t>(players_.size());
+    onMatch(requestedBots + missingPlayers, std::span<ENetPeer* const>{players_.data(), players_.size()});
+  }
+
+ private:
+  // Node based, tickets link to each other
+  std::unordered_map<ENetPeer*, Ticket> tickets_;
+  std::unordered_map<Key, Bucket> buckets_;
+
+  std::set<Key> full_;
+  // Oldest first
+  std::set<std::pair<Clock::time_point, Key>> heads_;
+
+  std::vector<ENetPeer*> players_;
+  std::vector<float> waitsMs_;
+};
@@ -21,6 +21,7 @@ class Replication
   {
     std::vector<std::byte> remoteState;
     std::deque<ReplState> localStates;
+    size_t lastDeltaBytes{0};
   };
 
   Derived& self() { return *static_cast<Derived*>(this); }
@@ -78,9 +79,18 @@ public:
     auto& replData = replication_.at(std::tuple{peer, chan});
 
     replData.remoteState = apply({replData.remoteState.data(), replData.remoteState.size()}, cont);
+    replData.lastDeltaBytes = cont.size();
     self().send(peer, chan, {}, PReplicationAck{ .sequence = packet.sequence });
 
-    self().handleReplication(peer, chan, std::span{replData.remoteState.data(), replData.remoteState.size()});
+    std::span state{replData.remoteState.data(), replData.remoteState.size()};
+    if constexpr (requires { self().handleReplication(peer, chan, state, packet.timestamp); })
+    {
+      self().handleReplication(peer, chan, state, packet.timestamp);
+    }
+    else
+    {
+      self().handleReplication(peer, chan, state);
+    }
   }
 
   void handlePacket(ENetPeer* peer, enet_uint8 chan, const PReplicationAck& packet)
@@ -100,12 +110,20 @@ public:
       });
   }
 
+  // Size of the last delta received, before applying it
+  size_t lastDeltaBytes(ENetPeer* peer, enet_uint8 channel) const
+  {
+    auto it = replication_.find(std::tuple{peer, channel});
+    return it == replication_.end() ? 0 : it->second.lastDeltaBytes;
+  }
+
   void stopReplication(ENetPeer* peer, enet_uint8 channel)
   {
     replication_.erase(std::make_tuple(peer, channel));
   }
 
-  void replicate(ENetPeer* peer, enet_uint8 channel, std::span<std::byte> bytes)
+  // timestamp is handed to the remote's handleReplication if it wants one
+  void replicate(ENetPeer* peer, enet_uint8 channel, std::span<std::byte> bytes, int64_t timestamp = 0)
   {
     auto& replData = replication_.at(std::tuple{peer, channel});
 
@@ -117,7 +135,7 @@ public:
     const auto& lastAckedState = replData.localStates.back();
 
     auto del = delta(lastAckedState, newState);
-    self().send(peer, channel, {}, PReplication{ .sequence = newState.sequence }, {del.data(), del.size()});
+    self().send(peer, channel, {}, PReplication{ .sequence = newState.sequence, .timestamp = timestamp }, {del.data(), del.size()});
   }
 
 private:
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include "assert.hpp"
+
+
+// Fixed-capacity FIFO over an inline array. Pushing into a full buffer
+// recycles the oldest slot in place, so elements that own memory
+// (e.g. vectors) keep their capacity and steady-state use never allocates.
+template<class T, size_t N>
+class RingBuffer
+{
+ public:
+  static constexpr size_t capacity() { return N; }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // 0 is the oldest element
+  T& operator[](size_t i) { NG_ASSERT(i < size_); return slots_[(head_ + i) % N]; }
+  const T& operator[](size_t i) const { NG_ASSERT(i < size_); return slots_[(head_ + i) % N]; }
+
+  T& front() { return (*this)[0]; }
+  const T& front() const { return (*this)[0]; }
+  T& back() { return (*this)[size_ - 1]; }
+  const T& back() const { return (*this)[size_ - 1]; }
+
+  // Returns the new last slot as it was left by its previous user
+  T& pushBack()
+  {
+    if (size_ == N)
+    {
+      popFront();
+    }
+    ++size_;
+    return back();
+  }
+
+  void pushBack(T value)
+  {
+    pushBack() = std::move(value);
+  }
+
+  void popFront()
+  {
+    NG_ASSERT(size_ > 0);
+    head_ = (head_ + 1) % N;
+    --size_;
+  }
+
+  void clear()
+  {
+    head_ = 0;
+    size_ = 0;
+  }
+
+ private:
+  std::array<T, N> slots_{};
+  size_t head_{0};
+  size_t size_{0};
+};
@@ -2,9 +2,14 @@
 
 #include <type_traits>
 #include <span>
+#include <vector>
 #include <enet/enet.h>
 #include <function2/function2.hpp>
 
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
 #include "common.hpp"
 #include "proto.hpp"
 
@@ -23,14 +28,16 @@ class Service
  public:
   Service(const ENetAddress * address, size_t peerCount, size_t channelLimit)
     : host_{enet_host_create(address, peerCount, channelLimit, 0, 0), &enet_host_destroy}
+    , receivedBytes_(channelLimit, 0)
   {
     NG_VERIFY(host_ != nullptr);
   }
 
+  // data is handed to the remote's connected(peer, data) if it has one
   template<class F>
-  void connect(ENetAddress address, F f)
+  void connect(ENetAddress address, F f, enet_uint32 data = 0)
   {
-    ENetPeer* peer = enet_host_connect(host_.get(), &address, 2, 0);
+    ENetPeer* peer = enet_host_connect(host_.get(), &address, 2, data);
     if (peer == nullptr)
     {
       f(peer);
@@ -69,6 +76,22 @@ class Service
 
   void poll(uint32_t timeoutMs = 30)
   {
+#ifndef _WIN32
+    // ENet only sleeps on its own socket, wake up for stdin as well
+    if constexpr (requires { self().inputFd(); })
+    {
+      if (int fd = self().inputFd(); fd != -1 && timeoutMs > 0)
+      {
+        std::array<pollfd, 2> fds{
+          pollfd{ .fd = host_->socket, .events = POLLIN, .revents = 0 },
+          pollfd{ .fd = fd, .events = POLLIN, .revents = 0 },
+        };
+        ::poll(fds.data(), fds.size(), static_cast<int>(timeoutMs));
+        timeoutMs = 0;
+      }
+    }
+#endif
+
     ENetEvent event;
     while (enet_host_service(host_.get(), &event, timeoutMs) > 0)
     {
@@ -83,7 +106,14 @@ class Service
           } // only servers can get abrupt connects
           else if constexpr (IS_SERVER)
           {
-            self().connected(event.peer);
+            if constexpr (requires { self().connected(event.peer, event.data); })
+            {
+              self().connected(event.peer, event.data);
+            }
+            else
+            {
+              self().connected(event.peer);
+            }
           }
           break;
 
@@ -104,6 +134,10 @@ class Service
         case ENET_EVENT_TYPE_RECEIVE:
           {
             cipher(event.peer, event.packet);
+            if (event.channelID < receivedBytes_.size())
+            {
+              receivedBytes_[event.channelID] += event.packet->dataLength;
+            }
             ENetPeer* peer = event.peer;
             uint8_t* data = event.packet->data;
             
@@ -171,6 +205,14 @@ class Service
     keys_[peer] = key;
   }
 
+  ENetHost* getHost() { return host_.get(); }
+
+  // Payload bytes received on a channel from all peers since start
+  uint64_t receivedBytes(enet_uint8 channel) const
+  {
+    return channel < receivedBytes_.size() ? receivedBytes_[channel] : 0;
+  }
+
 private:
   void connected(ENetPeer* peer)
   {
@@ -210,6 +252,7 @@ private:
  private:
   UniquePtr<ENetHost> host_;
   std::unordered_map<ENetPeer*, XorKey> keys_;
+  std::vector<uint64_t> receivedBytes_;
   std::unordered_map<ENetPeer*, fu2::function<void(ENetPeer*)>> pending_connect_;
   std::unordered_map<ENetPeer*, fu2::function<void()>> pending_disconnect_;
 };
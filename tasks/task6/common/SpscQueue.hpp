@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Each side owns one index and only reads the other's, so a push or pop
+// is a couple of loads and one release store.
+template<class T, size_t N>
+class SpscQueue
+{
+  static_assert((N & (N - 1)) == 0, "Capacity must be a power of two");
+
+ public:
+  // Producer only, false if the queue is full
+  bool push(T&& value)
+  {
+    const size_t tail = tail_.load(std::memory_order::relaxed);
+    if (tail - head_.load(std::memory_order::acquire) == N)
+    {
+      return false;
+    }
+
+    slots_[tail % N] = std::move(value);
+    tail_.store(tail + 1, std::memory_order::release);
+    return true;
+  }
+
+  // Consumer only, false if the queue is empty
+  bool pop(T& value)
+  {
+    const size_t head = head_.load(std::memory_order::relaxed);
+    if (head == tail_.load(std::memory_order::acquire))
+    {
+      return false;
+    }
+
+    value = std::move(slots_[head % N]);
+    head_.store(head + 1, std::memory_order::release);
+    return true;
+  }
+
+ private:
+  // Apart, so the two threads don't fight over one cache line
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::array<T, N> slots_;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+
+
+// Fixed-size history of (time, value) samples with a single writer and any
+// number of lock-free readers. Readers copy what they want and then check
+// that the writer hasn't lapped them in the meantime, dropping the samples
+// it could have overwritten, so the writer never waits for anybody.
+template<size_t N>
+class TimeSeries
+{
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  static constexpr size_t capacity() { return N; }
+
+  // Writer only
+  void push(Clock::time_point time, float value)
+  {
+    const uint64_t index = written_.load(std::memory_order::relaxed);
+    auto& slot = slots_[index % N];
+    slot.time.store(time.time_since_epoch().count(), std::memory_order::relaxed);
+    slot.value.store(value, std::memory_order::relaxed);
+    written_.store(index + 1, std::memory_order::release);
+  }
+
+  uint64_t written() const { return written_.load(std::memory_order::acquire); }
+
+  // Appends up to count of the newest samples, oldest first, times may be
+  // null. Returns how many were appended.
+  size_t copyLatest(size_t count, std::vector<Clock::time_point>* times, std::vector<float>& values) const
+  {
+    const uint64_t end = written_.load(std::memory_order::acquire);
+    const uint64_t begin = end - std::min<uint64_t>({count, N, end});
+
+    const auto timesBase = static_cast<ptrdiff_t>(times != nullptr ? times->size() : 0);
+    const auto valuesBase = static_cast<ptrdiff_t>(values.size());
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      const auto& slot = slots_[i % N];
+      if (times != nullptr)
+      {
+        times->emplace_back(Clock::duration{slot.time.load(std::memory_order::relaxed)});
+      }
+      values.push_back(slot.value.load(std::memory_order::relaxed));
+    }
+
+    // Anything below this may have been overwritten while we were reading,
+    // including the slot of index after, which may be half written
+    std::atomic_thread_fence(std::memory_order::acquire);
+    const uint64_t after = written_.load(std::memory_order::relaxed);
+    const uint64_t safeBegin = after >= N ? after - N + 1 : 0;
+    if (safeBegin > begin)
+    {
+      const auto torn = static_cast<ptrdiff_t>(std::min(safeBegin, end) - begin);
+      if (times != nullptr)
+      {
+        times->erase(times->begin() + timesBase, times->begin() + timesBase + torn);
+      }
+      values.erase(values.begin() + valuesBase, values.begin() + valuesBase + torn);
+    }
+
+    return values.size() - static_cast<size_t>(valuesBase);
+  }
+
+ private:
+  struct Slot
+  {
+    std::atomic<Clock::rep> time{0};
+    std::atomic<float> value{0};
+  };
+
+  std::array<Slot, N> slots_;
+  std::atomic<uint64_t> written_{0};
+};
+
+// A set of named series that can be written out as CSV in the background,
+// one "series,time_ms,value" row per sample, times relative to creation.
+template<size_t N>
+class TimeSeriesRecorder
+{
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  TimeSeriesRecorder()
+    : start_{Clock::now()}
+  {
+  }
+
+  ~TimeSeriesRecorder()
+  {
+    if (dumper_.joinable()) dumper_.join();
+  }
+
+  // Not thread safe, register everything before the first dump
+  TimeSeries<N>& add(std::string name)
+  {
+    auto& entry = series_.emplace_back(std::make_unique<Entry>());
+    entry->name = std::move(name);
+    return entry->series;
+  }
+
+  // Returns immediately, waits for the previous dump if it's still running
+  void dumpCsv(std::string path)
+  {
+    if (dumper_.joinable()) dumper_.join();
+
+    dumper_ = std::thread{
+      [this, path = std::move(path)]()
+      {
+        std::ofstream out(path);
+        if (!out)
+        {
+          spdlog::error("Can't open {} for writing", path);
+          return;
+        }
+
+        out << "series,time_ms,value\n";
+
+        std::vector<Clock::time_point> times;
+        std::vector<float> values;
+        for (const auto& entry : series_)
+        {
+          times.clear();
+          values.clear();
+          entry->series.copyLatest(N, &times, values);
+          for (size_t i = 0; i < values.size(); ++i)
+          {
+            out << entry->name << ','
+              << std::chrono::duration<double, std::milli>(times[i] - start_).count() << ','
+              << values[i] << '\n';
+          }
+        }
+
+        spdlog::info("Wrote diagnostics to {}", path);
+      }};
+  }
+
+ private:
+  struct Entry
+  {
+    std::string name;
+    TimeSeries<N> series;
+  };
+
+  Clock::time_point start_;
+  // Behind pointers so references handed out by add() stay put
+  std::vector<std::unique_ptr<Entry>> series_;
+  std::thread dumper_;
+};
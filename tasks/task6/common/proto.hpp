@@ -14,13 +14,18 @@ enum class PacketType : uint8_t
   RegisterServerInLobby,
 
   LobbyListUpdate,
+  LobbyListDelta,
+  QueryLobbies,
   CreateLobby,
   JoinLobby,
   JoinedLobby,
   LeaveLobby,
+  FindMatch,
+  CancelFindMatch,
   StartServerGame,
 
   SendKey,
+  ServerLoad,
 
   PlayerJoined,
   PlayerLeft,
@@ -28,6 +33,9 @@ enum class PacketType : uint8_t
   
   Replication,
   ReplicationAck,
+
+  TimeRequest,
+  TimeResponse,
   
   PossesEntity,
   COUNT,
@@ -49,7 +57,11 @@ struct Packet<PacketType::Name> : PacketBase<PacketType::Name>
 
 
 PROTO_IMPL_PACKET(StartLobby) { uint32_t id; };
-PROTO_IMPL_PACKET(StartServerGame) { uint32_t botCount; };
+PROTO_IMPL_PACKET(StartServerGame)
+{
+  uint32_t botCount;
+  uint32_t matchId;
+};
 
 
 PROTO_IMPL_PACKET(CreateLobby)
@@ -61,6 +73,11 @@ PROTO_IMPL_PACKET(JoinLobby) { uint32_t id; };
 PROTO_IMPL_PACKET(JoinedLobby) { uint32_t id; };
 PROTO_IMPL_PACKET(LeaveLobby) { uint32_t id; };
 
+// Puts the client in the matchmaking queue, it hears back with a
+// PJoinedLobby once grouped with others and then a PLobbyStarted
+PROTO_IMPL_PACKET(FindMatch) { uint32_t botCount; };
+PROTO_IMPL_PACKET(CancelFindMatch) {};
+
 struct LobbyEntry
 {
   std::array<char, 128> name;
@@ -69,18 +86,80 @@ struct LobbyEntry
   uint32_t botCount;
 };
 
+enum class LobbySort : uint8_t
+{
+  Newest,
+  Name,
+  Players,
+};
+
+struct LobbyQuery
+{
+  // Empty matches everything
+  std::array<char, 32> namePrefix;
+  uint32_t offset;
+  // Capped by the lobby at LobbyIndex::kMaxPageSize
+  uint32_t limit;
+  LobbySort sort;
+};
+
+// Subscribes the client to one page of the lobby list, replacing any
+// previous subscription. Answered with a PLobbyListUpdate right away and
+// PLobbyListDeltas whenever the page changes.
+PROTO_IMPL_PACKET(QueryLobbies) { LobbyQuery query; };
+
+// The whole subscribed page
 PROTO_IMPL_PACKET(LobbyListUpdate)
 {
   using Continuation = LobbyEntry;
+
+  uint64_t version;
+  // Lobbies matching the query, on all pages
+  uint32_t total;
+};
+
+struct LobbyCounts
+{
+  uint32_t id;
+  uint32_t playerCount;
+  uint32_t botCount;
+};
+
+// How the subscribed page changed since the previous version, the
+// continuation is a ByteOstream of span<LobbyEntry> added, span<LobbyCounts>
+// updated and span<uint32_t> removed. Entries come and go as lobbies move
+// across the page boundaries, so order is up to the client to restore.
+PROTO_IMPL_PACKET(LobbyListDelta)
+{
+  using Continuation = std::byte;
+
+  uint64_t version;
+  uint32_t total;
 };
 
 PROTO_IMPL_PACKET(LobbyStarted)
 {
   ENetAddress serverAddress;
+  // Passed as connection data when connecting to the game server
+  uint32_t matchId;
 };
 
 PROTO_IMPL_PACKET(RegisterClientInLobby) {};
-PROTO_IMPL_PACKET(RegisterServerInLobby) {};
+PROTO_IMPL_PACKET(RegisterServerInLobby) { uint32_t freeMatches; };
+
+// Sent by game servers to the lobby once a second and whenever a match slot frees up
+PROTO_IMPL_PACKET(ServerLoad)
+{
+  uint32_t freeMatches;
+  uint32_t playerCount;
+  uint32_t freePlayerSlots;
+  // Time spent simulating per server loop iteration since the previous report
+  float tickP50Ms;
+  float tickP99Ms;
+  float tickMaxMs;
+  // A p99 above this means the server is falling behind
+  float tickBudgetMs;
+};
 
 PROTO_IMPL_PACKET(PlayerJoined)
 {
@@ -97,6 +176,8 @@ PROTO_IMPL_PACKET(Replication)
   using Continuation = std::byte;
 
   uint64_t sequence;
+  // Sender's clock (see ClockSync.hpp) at the moment the state was current
+  int64_t timestamp;
 };
 
 PROTO_IMPL_PACKET(ReplicationAck)
@@ -110,6 +191,14 @@ PROTO_IMPL_PACKET(Chat)
   std::array<char, 1000> message;
 };
 
+// Times are microseconds since the sender's steady_clock epoch
+PROTO_IMPL_PACKET(TimeRequest) { int64_t requestTime; };
+PROTO_IMPL_PACKET(TimeResponse)
+{
+  int64_t requestTime;
+  int64_t responseTime;
+};
+
 using XorKey = std::array<char, 4>;
 
 PROTO_IMPL_PACKET(SendKey) { XorKey key; };
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+#include "Entity.hpp"
+
+
+enum class BotBehavior : uint8_t
+{
+  None, // not a bot, i.e. controlled by a player
+  Wander,
+  Chase,
+  Flee,
+};
+
+// AI component of an entity. Stored in a vector parallel to GameState:
+// bots[i] always belongs to state[i], removals move both together.
+struct BotState
+{
+  glm::vec2 target{0, 0};
+  BotBehavior behavior = BotBehavior::None;
+  // Time left until the bot looks around again
+  float thinkTimer = 0;
+  // Entity being chased or run away from
+  id_t other = kInvalidId;
+
+  static BotState wander(id_t id)
+  {
+    return BotState{
+      // derived from the id so that the same bots make the same first moves
+      .target = Entity::randomPos(id, kSpawnSeed),
+      .behavior = BotBehavior::Wander,
+      // spread the thinking across ticks
+      .thinkTimer = static_cast<float>(id % 8) / 8.f * kThinkInterval,
+    };
+  }
+
+  bool operator==(const BotState&) const = default;
+
+  static constexpr float kThinkInterval = 0.25f;
+  // Never produced by the simulation's per-tick streams, which are small
+  static constexpr uint64_t kSpawnSeed = ~uint64_t{0};
+};
+
+using BotStates = std::vector<BotState>;
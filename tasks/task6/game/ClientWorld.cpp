@@ -0,0 +1,182 @@
+#include "ClientWorld.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+using namespace std::chrono_literals;
+
+static float durationToSecs(ClientWorld::Clock::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::duration<float>>(d).count();
+}
+
+void ClientWorld::reset(Clock::time_point now)
+{
+  jitter_.restart();
+  snapshotHistory_.clear();
+  auto& initial = snapshotHistory_.pushBack();
+  initial.state.clear();
+  initial.time = now;
+}
+
+void ClientWorld::onSnapshot(std::span<const std::byte> bytes, Clock::time_point arrival, Clock::time_point time)
+{
+  // Switching to the server timeline may step back a little, never go backwards
+  if (!snapshotHistory_.empty())
+  {
+    time = std::max(time, snapshotHistory_.back().time + 1us);
+  }
+  jitter_.onArrival(arrival, time);
+
+  // Reuses the buffers of the oldest snapshot once the history is full
+  auto& newSnapshot = snapshotHistory_.pushBack();
+  newSnapshot.time = time;
+
+  const auto count = bytes.size() / sizeof(Entity);
+  NG_ASSERT(bytes.size() % sizeof(Entity) == 0);
+  newSnapshot.state.resize(count);
+  std::memcpy(newSnapshot.state.data(), bytes.data(), bytes.size());
+  // Sorted once here so that interpolation is a plain merge
+  std::sort(newSnapshot.state.begin(), newSnapshot.state.end(),
+    [](const Entity& a, const Entity& b) { return a.id < b.id; });
+  newSnapshot.index.rebuild(newSnapshot.state);
+}
+
+void ClientWorld::update(Clock::time_point now, float delta, Clock::duration roundTrip)
+{
+  auto time = now - jitter_.update(
+    std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(delta)));
+
+  std::optional<Entity> playerBackup;
+  if (auto player = entityById(playerEntityId_)) playerBackup = *player;
+
+  interpolate(time, state_);
+  index_.rebuild(state_);
+
+  if (auto player = entityById(playerEntityId_); player && playerBackup)
+  {
+      // keep local simulation position
+      player->pos = playerBackup->pos;
+  }
+
+  interpolatePlayer(now, delta, roundTrip);
+}
+
+// Writes into result, whose capacity is reused between frames
+void ClientWorld::interpolate(Clock::time_point time, GameState& result)
+{
+  while (snapshotHistory_.size() > 2 && snapshotHistory_[1].time < time)
+  {
+    snapshotHistory_.popFront();
+  }
+
+  if (snapshotHistory_.empty())
+  {
+    return;
+  }
+
+  // Ran past the newest snapshot: keep things moving for a little while,
+  // then freeze rather than let entities fly off on stale velocities
+  const auto& newest = snapshotHistory_.back();
+  bufferDepthMs_ = durationToSecs(newest.time - time)*1000.f;
+  if (snapshotHistory_.size() == 1 || time >= newest.time)
+  {
+    const float ahead = std::clamp(durationToSecs(time - newest.time),
+      0.f, durationToSecs(kMaxExtrapolation));
+
+    result.assign(newest.state.begin(), newest.state.end());
+    for (auto& entity : result)
+    {
+      entity.simulate(ahead);
+    }
+    return;
+  }
+
+  const auto& old = snapshotHistory_[0];
+  const auto& recent = snapshotHistory_[1];
+
+  result.clear();
+
+  const auto h = std::clamp(
+    durationToSecs(time - old.time) / durationToSecs(recent.time - old.time),
+    0.f, 1.f);
+
+  zipById(
+    std::span{old.state.data(), old.state.size()},
+    std::span{recent.state.data(), recent.state.size()},
+    [&result, h]
+    (const Entity& o, const Entity& r)
+    {
+      result.emplace_back(Entity{
+          .pos = r.pos*h + (1 - h)*o.pos,
+          .vel = r.vel,
+          .size = r.size*h + (1 - h)*o.size,
+          .color = r.color,
+          .id = r.id,
+        });
+    });
+}
+
+void ClientWorld::interpolatePlayer(Clock::time_point now, float delta, Clock::duration roundTrip)
+{
+  auto player = entityById(playerEntityId_);
+  if (player == nullptr)
+  {
+    return;
+  }
+
+  auto& entity = *player;
+
+  playerVelHistory_.pushBack(PlayerInputSnapshot{
+    .vel = playerDesiredSpeed_,
+    .time = now,
+  });
+  entity.vel = playerDesiredSpeed_;
+  entity.simulate(delta);
+  
+  if (playerServerPredicted_.has_value())
+  {
+    playerServerPredicted_->vel = playerDesiredSpeed_;
+    playerServerPredicted_->simulate(delta);
+
+    predictionError_ = glm::length(playerServerPredicted_->pos - entity.pos);
+
+    glm::vec2 compensation =
+      (playerServerPredicted_->pos - entity.pos) * delta;
+    if (glm::length(compensation) > entity.size/100.f)
+    {
+      entity.pos += compensation;
+      playerServerPredicted_->pos -= compensation;
+    }
+  }
+
+
+  const auto& snapshot = snapshotHistory_.back();
+
+  auto serverPlayer = snapshot.index.find(snapshot.state, playerEntityId_);
+  if (serverPlayer == nullptr)
+  {
+    return;
+  }
+
+  // std::chrono is f'n awesome
+  Clock::time_point last = snapshot.time - roundTrip/2;
+  while (!playerVelHistory_.empty()
+    && playerVelHistory_.front().time < last)
+  {
+    playerVelHistory_.popFront();
+  }
+
+  Entity predicted = entity;
+  predicted.pos = serverPlayer->pos;
+  for (size_t i = 0; i < playerVelHistory_.size(); ++i)
+  {
+    const auto&[vel, time] = playerVelHistory_[i];
+    predicted.vel = vel;
+    predicted.simulate(durationToSecs(time - last));
+    last = time;
+  }
+
+  playerServerPredicted_ = predicted;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <span>
+
+#include "Entity.hpp"
+#include "EntityIndex.hpp"
+#include "../common/JitterEstimator.hpp"
+#include "../common/RingBuffer.hpp"
+
+
+// Everything the client does to a replicated world: snapshot buffering,
+// interpolation and prediction of the local player. Knows nothing about
+// sockets or windows and takes all times as arguments, so it can be driven
+// by the real client, a benchmark or a replay at any rate.
+class ClientWorld
+{
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // How long entities keep moving on their last known velocity
+  static constexpr auto kMaxExtrapolation = std::chrono::milliseconds{200};
+
+  explicit ClientWorld(float expectedSnapshotIntervalMs = 100.f)
+    : jitter_{expectedSnapshotIntervalMs}
+  {
+  }
+
+  // Forgets the previous server's snapshots
+  void reset(Clock::time_point now);
+
+  // bytes is the replicated GameState, time the moment it was current on
+  // our timeline (the arrival time if the server's clock is unknown)
+  void onSnapshot(std::span<const std::byte> bytes, Clock::time_point arrival, Clock::time_point time);
+
+  // Advances the frame: interpolates everyone else and predicts the player
+  void update(Clock::time_point now, float delta, Clock::duration roundTrip);
+
+  void setPlayer(id_t id) { playerEntityId_ = id; }
+  id_t player() const { return playerEntityId_; }
+
+  void setInput(glm::vec2 vel) { playerDesiredSpeed_ = vel; }
+  glm::vec2 input() const { return playerDesiredSpeed_; }
+
+  Entity* entityById(id_t id) { return index_.find(state_, id); }
+  const GameState& state() const { return state_; }
+  const JitterEstimator& jitter() const { return jitter_; }
+
+  // How far the newest snapshot is ahead of what is being shown, negative when extrapolating
+  float bufferDepthMs() const { return bufferDepthMs_; }
+  // Distance between the shown player and where the server will have it
+  float predictionError() const { return predictionError_; }
+
+ private:
+  struct Snapshot
+  {
+    GameState state;
+    EntityIndex index;
+    Clock::time_point time;
+  };
+
+  struct PlayerInputSnapshot
+  {
+    glm::vec2 vel;
+    Clock::time_point time;
+  };
+
+  void interpolate(Clock::time_point time, GameState& result);
+  void interpolatePlayer(Clock::time_point now, float delta, Clock::duration roundTrip);
+
+ private:
+  id_t playerEntityId_{kInvalidId};
+  GameState state_;
+  EntityIndex index_;
+
+  // Has to cover JitterEstimator::kMaxDelayMs at the server's send rate
+  RingBuffer<Snapshot, 16> snapshotHistory_;
+  JitterEstimator jitter_;
+  float bufferDepthMs_{0};
+  float predictionError_{0};
+
+  glm::vec2 playerDesiredSpeed_{0,0};
+  // kostyl: we don't have a predicted pos for the first few frames
+  std::optional<Entity> playerServerPredicted_;
+  // A few seconds worth of frames, older inputs are long acknowledged
+  RingBuffer<PlayerInputSnapshot, 256> playerVelHistory_;
+};
@@ -41,3 +41,22 @@ glm::vec2 Entity::randomPos()
   };
 }
 
+static uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+glm::vec2 Entity::randomPos(id_t id, uint64_t seed)
+{
+  const uint64_t bits = splitmix64(splitmix64(seed) ^ id);
+  // 24 bits per coordinate is exactly representable in a float
+  constexpr float kScale = 1.f / static_cast<float>(1u << 24);
+  return {
+    static_cast<float>(bits & 0xffffff) * kScale,
+    static_cast<float>((bits >> 32) & 0xffffff) * kScale,
+  };
+}
+
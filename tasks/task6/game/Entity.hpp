@@ -24,6 +24,8 @@ struct Entity
   static id_t firstFreeId;
   static Entity create();
   static glm::vec2 randomPos();
+  // Stateless version of the above: the same seed always gives the same point
+  static glm::vec2 randomPos(id_t id, uint64_t seed);
 };
 
 using GameState = std::vector<Entity>;
@@ -31,14 +33,11 @@ using GameState = std::vector<Entity>;
 template<class T>
 concept HasId = requires(T t) { { t.id } -> std::convertible_to<id_t>; };
 
+// Calls f for every pair of elements with equal ids.
+// Both spans must already be sorted by id, this is a single linear merge.
 template<HasId T, HasId U, std::invocable<T&, U&> F>
 void zipById(std::span<T> first, std::span<U> second, F f)
 {
-  auto comp = [](const auto& fst, const auto& snd) { return fst.id < snd.id; };
-
-  std::sort(first.begin(), first.end(), comp);
-  std::sort(second.begin(), second.end(), comp);
-
   size_t i = 0;
   size_t j = 0;
   while (i < first.size() && j < second.size())
@@ -0,0 +1,41 @@
+#include "EntityIndex.hpp"
+
+
+void EntityIndex::grow(id_t id)
+{
+  if (id >= sparse_.size())
+  {
+    sparse_.resize(std::max<size_t>(static_cast<size_t>(id) + 1, sparse_.size()*2), kNoSlot);
+  }
+}
+
+void EntityIndex::rebuild(const GameState& state)
+{
+  for (uint32_t slot = 0; slot < state.size(); ++slot)
+  {
+    grow(state[slot].id);
+    sparse_[state[slot].id] = slot;
+  }
+}
+
+Entity& EntityIndex::insert(GameState& state, const Entity& entity)
+{
+  grow(entity.id);
+  sparse_[entity.id] = static_cast<uint32_t>(state.size());
+  return state.emplace_back(entity);
+}
+
+bool EntityIndex::erase(GameState& state, id_t id)
+{
+  const auto slot = slotOf(state, id);
+  if (slot == kNoSlot) return false;
+
+  if (slot + 1 != state.size())
+  {
+    state[slot] = state.back();
+    sparse_[state[slot].id] = slot;
+  }
+  state.pop_back();
+
+  return true;
+}
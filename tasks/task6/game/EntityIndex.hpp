@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Entity.hpp"
+#include "../common/assert.hpp"
+
+
+// Sparse set from entity ids to their slot in a GameState. The sparse side
+// is never cleared: a slot only counts if the entity stored there actually
+// has the requested id, so stale entries are harmless and rebuilds are O(n).
+// Ids are handed out sequentially, which keeps the sparse array compact.
+class EntityIndex
+{
+ public:
+  static constexpr uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
+
+  uint32_t slotOf(const GameState& state, id_t id) const
+  {
+    if (id >= sparse_.size()) return kNoSlot;
+
+    const auto slot = sparse_[id];
+    if (slot >= state.size() || state[slot].id != id) return kNoSlot;
+
+    return slot;
+  }
+
+  Entity* find(GameState& state, id_t id) const
+  {
+    const auto slot = slotOf(state, id);
+    return slot == kNoSlot ? nullptr : &state[slot];
+  }
+
+  const Entity* find(const GameState& state, id_t id) const
+  {
+    const auto slot = slotOf(state, id);
+    return slot == kNoSlot ? nullptr : &state[slot];
+  }
+
+  // Moves an already indexed id to another slot. Never reallocates,
+  // so different ids can be reassigned from different threads.
+  void assign(id_t id, uint32_t slot)
+  {
+    NG_ASSERT(id < sparse_.size());
+    sparse_[id] = slot;
+  }
+
+  void rebuild(const GameState& state);
+
+  Entity& insert(GameState& state, const Entity& entity);
+  // Swaps the last entity into the hole, returns false for unknown ids
+  bool erase(GameState& state, id_t id);
+
+ private:
+  void grow(id_t id);
+
+ private:
+  std::vector<uint32_t> sparse_;
+};
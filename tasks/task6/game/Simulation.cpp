@@ -0,0 +1,282 @@
+#include "Simulation.hpp"
+
+
+constexpr size_t kEntityGrain = 1024;
+constexpr size_t kCellGrain = 32;
+constexpr uint32_t kNoEntity = std::numeric_limits<uint32_t>::max();
+constexpr uint32_t kNoEater = kNoEntity;
+// How far bots look around for something to eat or to run from
+constexpr float kSightRadius = 0.25f;
+// A bot is scared of things this much bigger than itself and hunts things
+// this much smaller
+constexpr float kThreatRatio = 1.1f;
+
+// Separate random streams for bot retargeting and respawns
+static uint64_t retargetSeed(uint64_t tick) { return 2*tick; }
+static uint64_t respawnSeed(uint64_t tick) { return 2*tick + 1; }
+
+void Simulation::tick(GameState& state, EntityIndex& index, BotStates& bots, float dt, uint64_t tick)
+{
+  NG_ASSERT(state.size() == bots.size());
+
+  grid_.build(state);
+  think(state, index, bots, dt, tick);
+  integrate(state, bots, dt);
+  // Not reusable: integrate moved everything out of the cells the bots
+  // looked around in, and collisions must see where entities ended up or
+  // overlapping entities in different stale cells would never meet
+  grid_.build(state);
+  collide(state, tick);
+  compact(state, index, bots);
+}
+
+void Simulation::perceive(const GameState& state, uint32_t self, BotState& bot) const
+{
+  const auto& me = state[self];
+
+  // Running away beats eating, and closer things beat farther ones
+  uint32_t threat = kNoEntity;
+  float threatDist = kSightRadius;
+  uint32_t prey = kNoEntity;
+  float preyDist = kSightRadius;
+
+  grid_.forEachNear(me.pos, kSightRadius + grid_.maxSize(),
+    [&](uint32_t j)
+    {
+      if (j == self) return;
+
+      const auto& other = state[j];
+      const float dist = glm::length(other.pos - me.pos);
+
+      if (other.size > me.size*kThreatRatio)
+      {
+        const float edgeDist = dist - other.size;
+        if (edgeDist < threatDist)
+        {
+          threatDist = edgeDist;
+          threat = j;
+        }
+      }
+      else if (other.size*kThreatRatio < me.size && dist < preyDist)
+      {
+        preyDist = dist;
+        prey = j;
+      }
+    });
+
+  if (threat != kNoEntity)
+  {
+    bot.behavior = BotBehavior::Flee;
+    bot.other = state[threat].id;
+  }
+  else if (prey != kNoEntity)
+  {
+    bot.behavior = BotBehavior::Chase;
+    bot.other = state[prey].id;
+  }
+  else if (bot.behavior != BotBehavior::Wander)
+  {
+    bot.behavior = BotBehavior::Wander;
+    bot.other = kInvalidId;
+    bot.target = me.pos;
+  }
+}
+
+void Simulation::think(const GameState& state, const EntityIndex& index,
+  BotStates& bots, float dt, uint64_t tick)
+{
+  // Every job writes only the bots in its range and reads the world,
+  // which nobody modifies during this pass.
+  jobs_.parallelFor(bots.size(), kEntityGrain,
+    [this, &state, &index, &bots, dt, tick](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; ++i)
+      {
+        auto& bot = bots[i];
+        if (bot.behavior == BotBehavior::None) continue;
+
+        const auto& me = state[i];
+
+        bot.thinkTimer -= dt;
+        if (bot.thinkTimer <= 0)
+        {
+          bot.thinkTimer += BotState::kThinkInterval;
+          perceive(state, static_cast<uint32_t>(i), bot);
+        }
+
+        const Entity* other = bot.other != kInvalidId
+          ? index.find(state, bot.other)
+          : nullptr;
+
+        switch (bot.behavior)
+        {
+          case BotBehavior::Chase:
+            if (other != nullptr && other->size < me.size)
+            {
+              bot.target = other->pos;
+              break;
+            }
+            bot.behavior = BotBehavior::Wander;
+            bot.target = me.pos;
+            break;
+
+          case BotBehavior::Flee:
+            if (other != nullptr && glm::length(me.pos - other->pos) > 1e-3)
+            {
+              auto away = me.pos + glm::normalize(me.pos - other->pos)*kSightRadius;
+              bot.target = glm::clamp(away, glm::vec2{0, 0}, glm::vec2{1, 1});
+              break;
+            }
+            bot.behavior = BotBehavior::Wander;
+            bot.target = me.pos;
+            break;
+
+          default:
+            break;
+        }
+
+        if (bot.behavior == BotBehavior::Wander
+          && glm::length(bot.target - me.pos) < 1e-3)
+        {
+          bot.target = Entity::randomPos(me.id, retargetSeed(tick));
+        }
+      }
+    });
+}
+
+void Simulation::integrate(GameState& state, const BotStates& bots, float dt)
+{
+  jobs_.parallelFor(state.size(), kEntityGrain,
+    [&state, &bots, dt](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; ++i)
+      {
+        auto& entity = state[i];
+        const auto& bot = bots[i];
+
+        if (bot.behavior != BotBehavior::None)
+        {
+          auto v = bot.target - entity.pos;
+          auto len = glm::length(v);
+          entity.vel = len < 1e-3 ? glm::vec2{0, 0} : v / len * 0.2f;
+        }
+
+        entity.simulate(dt);
+      }
+    });
+}
+
+void Simulation::collide(const GameState& state, uint64_t tick)
+{
+  eater_.resize(state.size());
+  next_.resize(state.size());
+
+  // Pass 1: every entity picks at most one entity that fully contains it.
+  // The biggest one wins, ties go to the smaller id.
+  jobs_.parallelFor(grid_.cellCount(), kCellGrain,
+    [this, &state](size_t begin, size_t end)
+    {
+      for (size_t c = begin; c < end; ++c)
+      {
+        for (auto i : grid_.cell(static_cast<uint32_t>(c)))
+        {
+          const auto& e = state[i];
+          uint32_t best = kNoEater;
+
+          const float reach = grid_.maxSize() - e.size;
+          if (reach > 0)
+          {
+            grid_.forEachNear(e.pos, reach,
+              [&state, &e, &best, i](uint32_t j)
+              {
+                if (j == i) return;
+
+                const auto& other = state[j];
+                if (glm::length(e.pos - other.pos) + e.size >= other.size) return;
+
+                if (best == kNoEater
+                  || other.size > state[best].size
+                  || (other.size == state[best].size && other.id < state[best].id))
+                {
+                  best = j;
+                }
+              });
+          }
+
+          eater_[i] = best;
+        }
+      }
+    });
+
+  // Pass 2: every entity gathers what it ate in grid order, so the float
+  // sums come out the same no matter which thread processes the region.
+  jobs_.parallelFor(grid_.cellCount(), kCellGrain,
+    [this, &state, tick](size_t begin, size_t end)
+    {
+      for (size_t c = begin; c < end; ++c)
+      {
+        for (auto j : grid_.cell(static_cast<uint32_t>(c)))
+        {
+          Entity next = state[j];
+
+          if (eater_[j] != kNoEater)
+          {
+            next.size /= 2;
+            next.pos = Entity::randomPos(next.id, respawnSeed(tick));
+          }
+
+          grid_.forEachNear(state[j].pos, state[j].size,
+            [this, &state, &next, j](uint32_t i)
+            {
+              if (eater_[i] == j)
+              {
+                next.size += state[i].size/2;
+              }
+            });
+
+          next_[j] = next;
+        }
+      }
+    });
+}
+
+void Simulation::compact(GameState& state, EntityIndex& index, BotStates& bots)
+{
+  const size_t count = next_.size();
+  const size_t chunks = (count + kEntityGrain - 1) / kEntityGrain;
+
+  auto alive = [](const Entity& e) { return e.size >= 1e-3; };
+
+  chunkOffsets_.assign(chunks + 1, 0);
+  nextBots_.resize(count);
+  jobs_.parallelFor(count, kEntityGrain,
+    [this, &bots, &alive](size_t begin, size_t end)
+    {
+      std::copy(bots.begin() + begin, bots.begin() + end, nextBots_.begin() + begin);
+      chunkOffsets_[begin / kEntityGrain + 1] =
+        std::count_if(next_.begin() + begin, next_.begin() + end, alive);
+    });
+
+  for (size_t c = 0; c < chunks; ++c)
+  {
+    chunkOffsets_[c + 1] += chunkOffsets_[c];
+  }
+
+  // Stable, so the serial and parallel runs agree on the order too
+  state.resize(chunkOffsets_.back());
+  bots.resize(chunkOffsets_.back());
+  jobs_.parallelFor(count, kEntityGrain,
+    [this, &state, &index, &bots, &alive](size_t begin, size_t end)
+    {
+      size_t out = chunkOffsets_[begin / kEntityGrain];
+      for (size_t i = begin; i < end; ++i)
+      {
+        if (alive(next_[i]))
+        {
+          index.assign(next_[i].id, static_cast<uint32_t>(out));
+          bots[out] = nextBots_[i];
+          state[out++] = next_[i];
+        }
+      }
+    });
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Bot.hpp"
+#include "Entity.hpp"
+#include "EntityIndex.hpp"
+#include "SpatialGrid.hpp"
+#include "../common/JobSystem.hpp"
+
+
+// Server world tick as a pipeline of phases where every job writes only to
+// its own entity slot and reads the previous phase's output. This makes the
+// result independent of scheduling: running it on JobSystem(0) is the
+// serial reference and must produce bit-identical state.
+class Simulation
+{
+ public:
+  explicit Simulation(JobSystem& jobs)
+    : jobs_{jobs}
+  {
+  }
+
+  // bots must be aligned with state, both stay aligned after removals
+  // and index keeps pointing at the right slots
+  void tick(GameState& state, EntityIndex& index, BotStates& bots, float dt, uint64_t tick);
+
+ private:
+  void think(const GameState& state, const EntityIndex& index, BotStates& bots, float dt, uint64_t tick);
+  void perceive(const GameState& state, uint32_t self, BotState& bot) const;
+  void integrate(GameState& state, const BotStates& bots, float dt);
+  void collide(const GameState& state, uint64_t tick);
+  void compact(GameState& state, EntityIndex& index, BotStates& bots);
+
+ private:
+  JobSystem& jobs_;
+
+  SpatialGrid grid_;
+  // Index of the entity that swallows the one in this slot, if any
+  std::vector<uint32_t> eater_;
+  GameState next_;
+  BotStates nextBots_;
+  std::vector<size_t> chunkOffsets_;
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "Entity.hpp"
+
+
+// Uniform grid over the [0, 1]^2 playfield. Entities that wander outside
+// of it are clamped into the border cells, so queries stay correct.
+// Indices inside a cell are ascending, which makes iteration order
+// (and hence any float accumulation over it) deterministic.
+class SpatialGrid
+{
+ public:
+  explicit SpatialGrid(uint32_t cellsPerSide = 32)
+    : cellsPerSide_{cellsPerSide}
+  {
+  }
+
+  void build(std::span<const Entity> entities)
+  {
+    const uint32_t cells = cellCount();
+
+    cellOf_.resize(entities.size());
+    cellStart_.assign(cells + 1, 0);
+    maxSize_ = 0;
+
+    for (size_t i = 0; i < entities.size(); ++i)
+    {
+      const auto& entity = entities[i];
+      cellOf_[i] = cellIndex(coord(entity.pos.x), coord(entity.pos.y));
+      ++cellStart_[cellOf_[i] + 1];
+      maxSize_ = std::max(maxSize_, entity.size);
+    }
+
+    for (uint32_t c = 0; c < cells; ++c)
+    {
+      cellStart_[c + 1] += cellStart_[c];
+    }
+
+    cursor_.assign(cellStart_.begin(), cellStart_.end() - 1);
+    indices_.resize(entities.size());
+    for (size_t i = 0; i < entities.size(); ++i)
+    {
+      indices_[cursor_[cellOf_[i]]++] = static_cast<uint32_t>(i);
+    }
+  }
+
+  uint32_t cellCount() const { return cellsPerSide_*cellsPerSide_; }
+
+  std::span<const uint32_t> cell(uint32_t c) const
+  {
+    return std::span{indices_}.subspan(cellStart_[c], cellStart_[c + 1] - cellStart_[c]);
+  }
+
+  float maxSize() const { return maxSize_; }
+
+  // Calls f(index) for every entity in the cells overlapping the square
+  // of half-extent radius around pos. Callers do the exact distance test.
+  template<class F>
+  void forEachNear(glm::vec2 pos, float radius, F f) const
+  {
+    const uint32_t x0 = coord(pos.x - radius);
+    const uint32_t x1 = coord(pos.x + radius);
+    const uint32_t y0 = coord(pos.y - radius);
+    const uint32_t y1 = coord(pos.y + radius);
+
+    for (uint32_t y = y0; y <= y1; ++y)
+    {
+      for (uint32_t x = x0; x <= x1; ++x)
+      {
+        for (auto index : cell(cellIndex(x, y)))
+        {
+          f(index);
+        }
+      }
+    }
+  }
+
+ private:
+  uint32_t coord(float v) const
+  {
+    const float scaled = std::floor(v * static_cast<float>(cellsPerSide_));
+    if (!(scaled > 0)) return 0;
+    if (scaled >= static_cast<float>(cellsPerSide_)) return cellsPerSide_ - 1;
+    return static_cast<uint32_t>(scaled);
+  }
+
+  uint32_t cellIndex(uint32_t x, uint32_t y) const { return y*cellsPerSide_ + x; }
+
+ private:
+  uint32_t cellsPerSide_;
+  float maxSize_{0};
+
+  std::vector<uint32_t> cellOf_;
+  std::vector<uint32_t> cellStart_;
+  std::vector<uint32_t> cursor_;
+  std::vector<uint32_t> indices_;
+};
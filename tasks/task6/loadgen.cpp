@@ -0,0 +1,446 @@
+#include <iostream>
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include <optional>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+#include "common/assert.hpp"
+#include "common/Service.hpp"
+#include "common/Replication.hpp"
+#include "common/proto.hpp"
+
+#include "game/Entity.hpp"
+#include "game/gameProto.hpp"
+
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+static float durationToMs(Clock::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(d).count();
+}
+
+enum class InputMode
+{
+  Random,
+  Circle,
+};
+
+struct LoadConfig
+{
+  uint32_t playersPerMatch;
+  uint32_t botsPerMatch;
+  InputMode input;
+};
+
+// Samples gathered between two reports, merged across all hosts
+struct LoadStats
+{
+  std::vector<float> snapshotIntervalsMs;
+  std::vector<float> rttsMs;
+  std::vector<float> deltaBytes;
+  std::vector<float> entityCounts;
+  uint64_t bytesIn{0};
+  uint64_t bytesOut{0};
+  uint32_t connecting{0};
+  uint32_t playing{0};
+  uint32_t dropped{0};
+
+  void merge(LoadStats& other)
+  {
+    auto append =
+      [](std::vector<float>& to, std::vector<float>& from)
+      {
+        to.insert(to.end(), from.begin(), from.end());
+        from.clear();
+      };
+    append(snapshotIntervalsMs, other.snapshotIntervalsMs);
+    append(rttsMs, other.rttsMs);
+    append(deltaBytes, other.deltaBytes);
+    append(entityCounts, other.entityCounts);
+    bytesIn += std::exchange(other.bytesIn, 0);
+    bytesOut += std::exchange(other.bytesOut, 0);
+    connecting += std::exchange(other.connecting, 0);
+    playing += std::exchange(other.playing, 0);
+    dropped += std::exchange(other.dropped, 0);
+  }
+
+  static float percentile(std::vector<float>& samples, float p)
+  {
+    if (samples.empty()) return 0;
+
+    auto nth = samples.begin() + static_cast<ptrdiff_t>(p*static_cast<float>(samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+  }
+
+  static float mean(const std::vector<float>& samples)
+  {
+    if (samples.empty()) return 0;
+
+    double sum = 0;
+    for (auto s : samples) sum += s;
+    return static_cast<float>(sum / static_cast<double>(samples.size()));
+  }
+};
+
+// Drives a batch of simulated players over a single ENetHost: every one
+// of them has its own peers, keys and replication channels, so the lobby
+// and the game servers can't tell them apart from real clients.
+class LoadGen
+  : public Service<LoadGen>
+  , public Replication<LoadGen>
+{
+  static constexpr auto kSendRate = 60ms;
+
+  enum class Stage
+  {
+    ConnectingLobby,
+    InLobby,
+    ConnectingServer,
+    Playing,
+    Dropped,
+  };
+
+  struct Player
+  {
+    Stage stage{Stage::ConnectingLobby};
+    uint32_t group;
+    ENetPeer* lobby{nullptr};
+    ENetPeer* server{nullptr};
+    id_t entityId{kInvalidId};
+
+    glm::vec2 input{0, 0};
+    Clock::time_point nextTurn;
+    Clock::time_point lastSend;
+    Clock::time_point lastSnapshot;
+  };
+
+  struct Group
+  {
+    std::optional<uint32_t> lobbyId;
+    uint32_t joined{0};
+  };
+
+ public:
+  LoadGen(uint32_t hostIndex, uint32_t players, const LoadConfig& config)
+    : Service(nullptr, 2*players, 2)
+    , hostIndex_{hostIndex}
+    , config_{config}
+    , players_(players)
+    , groups_((players + config.playersPerMatch - 1) / config.playersPerMatch)
+    , random_{hostIndex}
+  {
+    for (uint32_t i = 0; i < players; ++i)
+    {
+      players_[i].group = i / config_.playersPerMatch;
+    }
+  }
+
+  void start(ENetAddress lobbyAddress)
+  {
+    for (uint32_t i = 0; i < players_.size(); ++i)
+    {
+      connect(lobbyAddress,
+        [this, i](ENetPeer* lobby)
+        {
+          NG_VERIFY(lobby != nullptr);
+          auto& player = players_[i];
+          player.lobby = lobby;
+          player.stage = Stage::InLobby;
+          peers_[lobby] = i;
+
+          send(lobby, 0, ENET_PACKET_FLAG_RELIABLE, PRegisterClientInLobby{});
+
+          if (isLeader(i))
+          {
+            PCreateLobby packet{ .name = {0}, .botCount = config_.botsPerMatch };
+            auto name = fmt::format("loadgen-{}-{}", hostIndex_, player.group);
+            std::strncpy(packet.name.data(), name.c_str(), packet.name.size() - 1);
+            send(lobby, 0, ENET_PACKET_FLAG_RELIABLE, packet);
+          }
+          else if (auto id = groups_[player.group].lobbyId)
+          {
+            send(lobby, 0, ENET_PACKET_FLAG_RELIABLE, PJoinLobby{ .id = *id });
+          }
+        });
+    }
+  }
+
+  using Replication::handlePacket;
+
+  // Nobody is browsing
+  void handlePacket(ENetPeer*, enet_uint8, const PLobbyListUpdate&, std::span<LobbyEntry>) {}
+  void handlePacket(ENetPeer*, enet_uint8, const PLobbyListDelta&, std::span<std::byte>) {}
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PJoinedLobby& packet)
+  {
+    auto* player = playerOf(peer);
+    if (player == nullptr) return;
+
+    auto& group = groups_[player->group];
+
+    if (isLeader(indexOf(peer)) && !group.lobbyId.has_value())
+    {
+      group.lobbyId = packet.id;
+
+      // Everybody who made it to the lobby before us was waiting
+      for (uint32_t i = firstOf(player->group); i < endOf(player->group); ++i)
+      {
+        if (!isLeader(i) && players_[i].stage == Stage::InLobby)
+        {
+          send(players_[i].lobby, 0, ENET_PACKET_FLAG_RELIABLE, PJoinLobby{ .id = packet.id });
+        }
+      }
+    }
+
+    if (++group.joined == endOf(player->group) - firstOf(player->group))
+    {
+      send(players_[firstOf(player->group)].lobby, 0, ENET_PACKET_FLAG_RELIABLE,
+        PStartLobby{ .id = *group.lobbyId });
+    }
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PLobbyStarted& packet)
+  {
+    auto* player = playerOf(peer);
+    if (player == nullptr) return;
+
+    const auto index = indexOf(peer);
+    peers_.erase(peer);
+    disconnect(std::exchange(player->lobby, nullptr), []() {});
+    player->stage = Stage::ConnectingServer;
+
+    connect(packet.serverAddress,
+      [this, index](ENetPeer* server)
+      {
+        NG_VERIFY(server != nullptr);
+        auto& player = players_[index];
+        player.server = server;
+        player.lastSnapshot = Clock::now();
+        peers_[server] = index;
+        setupReplication(server, 1);
+      },
+      packet.matchId);
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PSendKey& packet)
+  {
+    setKeyFor(peer, packet.key);
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PPossesEntity& packet)
+  {
+    if (auto* player = playerOf(peer))
+    {
+      player->entityId = packet.id;
+      player->stage = Stage::Playing;
+    }
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8 chan, const PReplication& packet, std::span<std::byte> cont)
+  {
+    stats_.deltaBytes.push_back(static_cast<float>(cont.size()));
+    Replication::handlePacket(peer, chan, packet, cont);
+  }
+
+  void handleReplication(ENetPeer* peer, enet_uint8, std::span<std::byte> bytes)
+  {
+    auto* player = playerOf(peer);
+    if (player == nullptr) return;
+
+    auto now = Clock::now();
+    stats_.snapshotIntervalsMs.push_back(durationToMs(now - std::exchange(player->lastSnapshot, now)));
+    stats_.entityCounts.push_back(static_cast<float>(bytes.size() / sizeof(Entity)));
+  }
+
+  void disconnected(ENetPeer* peer)
+  {
+    if (auto* player = playerOf(peer))
+    {
+      spdlog::warn("Simulated player {}:{} got disconnected", hostIndex_, indexOf(peer));
+      player->stage = Stage::Dropped;
+      player->lobby = nullptr;
+      player->server = nullptr;
+      peers_.erase(peer);
+    }
+  }
+
+  void update(Clock::time_point now)
+  {
+    for (auto& player : players_)
+    {
+      if (player.stage != Stage::Playing) continue;
+
+      steer(player, now);
+
+      if (now - player.lastSend > kSendRate)
+      {
+        player.lastSend = now;
+        auto packed = glm::packSnorm2x16(player.input);
+        replicate(player.server, 1, {reinterpret_cast<std::byte*>(&packed), sizeof(packed)});
+      }
+    }
+  }
+
+  void collectStats(LoadStats& into)
+  {
+    for (auto& player : players_)
+    {
+      switch (player.stage)
+      {
+        case Stage::Playing:
+          ++stats_.playing;
+          stats_.rttsMs.push_back(static_cast<float>(player.server->roundTripTime));
+          break;
+        case Stage::Dropped:
+          ++stats_.dropped;
+          break;
+        default:
+          ++stats_.connecting;
+          break;
+      }
+    }
+
+    auto* host = getHost();
+    stats_.bytesIn += std::exchange(host->totalReceivedData, 0);
+    stats_.bytesOut += std::exchange(host->totalSentData, 0);
+
+    into.merge(stats_);
+  }
+
+ private:
+  void steer(Player& player, Clock::time_point now)
+  {
+    switch (config_.input)
+    {
+      case InputMode::Random:
+        if (now > player.nextTurn)
+        {
+          std::uniform_real_distribution<float> axis(-1, 1);
+          std::uniform_int_distribution<int> turnMs(500, 2000);
+          player.input = {axis(random_), axis(random_)};
+          player.nextTurn = now + turnMs(random_) * 1ms;
+        }
+        break;
+
+      case InputMode::Circle:
+        {
+          // Everybody runs circles, phase shifted by entity id
+          float t = durationToMs(now.time_since_epoch()) / 1000.f + static_cast<float>(player.entityId);
+          player.input = {std::cos(t), std::sin(t)};
+        }
+        break;
+    }
+  }
+
+  Player* playerOf(ENetPeer* peer)
+  {
+    auto it = peers_.find(peer);
+    return it == peers_.end() ? nullptr : &players_[it->second];
+  }
+
+  uint32_t indexOf(ENetPeer* peer) const { return peers_.at(peer); }
+
+  uint32_t firstOf(uint32_t group) const { return group*config_.playersPerMatch; }
+  uint32_t endOf(uint32_t group) const
+  {
+    return std::min<uint32_t>(firstOf(group + 1), static_cast<uint32_t>(players_.size()));
+  }
+  bool isLeader(uint32_t index) const { return index % config_.playersPerMatch == 0; }
+
+ private:
+  uint32_t hostIndex_;
+  LoadConfig config_;
+
+  std::vector<Player> players_;
+  std::vector<Group> groups_;
+  std::unordered_map<ENetPeer*, uint32_t> peers_;
+
+  std::default_random_engine random_;
+  LoadStats stats_;
+};
+
+int main(int argc, char** argv)
+{
+  if (argc < 4 || argc > 7)
+  {
+    spdlog::error("Usage: {} <lobby addr> <lobby port> <players> [players per match] [bots per match] [random|circle]\n", argv[0]);
+    return -1;
+  }
+
+  NG_VERIFY(enet_initialize() == 0);
+  std::atexit(enet_deinitialize);
+
+  ENetAddress lobbyAddress;
+  enet_address_set_host(&lobbyAddress, argv[1]);
+  lobbyAddress.port = static_cast<enet_uint16>(std::atoi(argv[2]));
+
+  const auto players = static_cast<uint32_t>(std::max(std::atoi(argv[3]), 1));
+  const LoadConfig config{
+    .playersPerMatch = argc >= 5 ? static_cast<uint32_t>(std::max(std::atoi(argv[4]), 1)) : 8,
+    .botsPerMatch = argc >= 6 ? static_cast<uint32_t>(std::max(std::atoi(argv[5]), 0)) : 10,
+    .input = argc == 7 && std::string_view{argv[6]} == "circle" ? InputMode::Circle : InputMode::Random,
+  };
+
+  // ENet caps peers per host at 4096 and every player needs two of them
+  // while moving from the lobby to the server, so spread over several hosts.
+  // Matches never span hosts.
+  constexpr uint32_t kMaxPlayersPerHost = 1024;
+  const uint32_t perHost = std::max(kMaxPlayersPerHost / config.playersPerMatch, 1u) * config.playersPerMatch;
+
+  std::vector<std::unique_ptr<LoadGen>> hosts;
+  for (uint32_t first = 0; first < players; first += perHost)
+  {
+    auto& host = hosts.emplace_back(std::make_unique<LoadGen>(
+      static_cast<uint32_t>(hosts.size()), std::min(perHost, players - first), config));
+    host->start(lobbyAddress);
+  }
+
+  spdlog::info("Simulating {} players in matches of {} over {} hosts", players, config.playersPerMatch, hosts.size());
+
+  constexpr auto kReportRate = 5s;
+  auto lastReport = Clock::now();
+
+  while (true)
+  {
+    auto now = Clock::now();
+
+    for (auto& host : hosts)
+    {
+      host->poll(0);
+      host->update(now);
+    }
+
+    if (now - lastReport > kReportRate)
+    {
+      const float secs = std::chrono::duration<float>(now - std::exchange(lastReport, now)).count();
+
+      LoadStats stats;
+      for (auto& host : hosts)
+      {
+        host->collectStats(stats);
+      }
+
+      spdlog::info("players: {} playing, {} connecting, {} dropped | in {:.1f} KiB/s, out {:.1f} KiB/s | {:.0f} snapshots/s",
+        stats.playing, stats.connecting, stats.dropped,
+        static_cast<float>(stats.bytesIn) / 1024.f / secs, static_cast<float>(stats.bytesOut) / 1024.f / secs,
+        static_cast<float>(stats.snapshotIntervalsMs.size()) / secs);
+      // Servers send every 100ms, anything above that means their ticks run late
+      spdlog::info("snapshot interval ms: p50 {:.1f} p99 {:.1f} max {:.1f} | rtt ms: p50 {:.0f} p99 {:.0f}",
+        LoadStats::percentile(stats.snapshotIntervalsMs, 0.5f), LoadStats::percentile(stats.snapshotIntervalsMs, 0.99f),
+        LoadStats::percentile(stats.snapshotIntervalsMs, 1.f),
+        LoadStats::percentile(stats.rttsMs, 0.5f), LoadStats::percentile(stats.rttsMs, 0.99f));
+      spdlog::info("delta bytes: avg {:.0f} p99 {:.0f} max {:.0f} | entities per snapshot: avg {:.0f}",
+        LoadStats::mean(stats.deltaBytes), LoadStats::percentile(stats.deltaBytes, 0.99f),
+        LoadStats::percentile(stats.deltaBytes, 1.f), LoadStats::mean(stats.entityCounts));
+    }
+
+    std::this_thread::sleep_for(1ms);
+  }
+
+  return 0;
+}
@@ -2,173 +2,797 @@
 #include <spdlog/spdlog.h>
 #include <unordered_set>
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <variant>
+
+#ifndef _WIN32
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 #include "common/assert.hpp"
 #include "common/common.hpp"
 #include "common/Service.hpp"
 #include "common/AsyncInput.hpp"
+#include "common/bytestream.hpp"
+#include "common/LobbyIndex.hpp"
+#include "common/MatchmakingQueue.hpp"
+#include "common/SpscQueue.hpp"
 #include "common/proto.hpp"
 
 
 using namespace std::chrono_literals;
 
+// A player's place in a lobby. Owned by LobbyShard::members_, which is
+// also the peer to lobby index, and linked into its lobby's player list,
+// so joining and leaving never search anything.
+struct Member
+{
+  ENetPeer* peer;
+  uint32_t lobbyId;
+  Member* prev{nullptr};
+  Member* next{nullptr};
+};
+
 struct Lobby
 {
   std::string name;
   uint32_t botCount;
-  std::vector<ENetPeer*> players;
+  Member* players{nullptr};
+  uint32_t playerCount{0};
 };
 
-class LobbyService
-  : public Service<LobbyService, true>
+static LobbyEntry entryOf(uint32_t id, const Lobby& lobby)
+{
+  LobbyEntry entry{
+    .name = {0},
+    .id = id,
+    .playerCount = lobby.playerCount,
+    .botCount = lobby.botCount,
+  };
+  std::strncpy(entry.name.data(), lobby.name.c_str(), entry.name.size() - 1);
+  return entry;
+}
+
+// A shard's lobbies as of its last publish, only ever read after that
+struct ShardSnapshot
+{
+  LobbyIndex index;
+  std::unordered_map<uint32_t, LobbyEntry> entries;
+};
+
+// Owns the lobbies whose id maps to it and runs on a thread of its own.
+// The front-end posts commands through a lock-free queue and collects the
+// resulting events in batches, it never touches the shard's tables. Shards
+// don't send anything themselves, an ENet host is single-threaded.
+class LobbyShard
 {
-  using Clock = std::chrono::steady_clock;
  public:
-  LobbyService(ENetAddress addr)
-    : Service(&addr, 32, 2)
+  // Commands, from the front-end
+  struct Create
+  {
+    uint32_t id;
+    std::string name;
+    uint32_t botCount;
+    std::vector<ENetPeer*> players;
+    // Straight from matchmaking, never shows up in the list
+    bool start;
+  };
+  struct Join { ENetPeer* peer; uint32_t id; };
+  struct Leave { ENetPeer* peer; uint32_t id; };
+  struct Start { uint32_t id; };
+  struct Publish {};
+  using Command = std::variant<Create, Join, Leave, Start, Publish>;
+
+  // Events, back to the front-end
+  struct Joined { ENetPeer* peer; uint32_t id; };
+  struct JoinFailed { ENetPeer* peer; uint32_t id; };
+  // The lobby is gone from the shard, its players are the front-end's now
+  struct Started
+  {
+    uint32_t id;
+    std::string name;
+    uint32_t botCount;
+    std::vector<ENetPeer*> players;
+  };
+  struct StartFailed { uint32_t id; };
+  struct Published
+  {
+    size_t shard;
+    std::shared_ptr<const ShardSnapshot> snapshot;
+  };
+  using Event = std::variant<Joined, JoinFailed, Started, StartFailed, Published>;
+
+  // wakeFd is written to whenever events are ready, -1 for none
+  LobbyShard(size_t index, int wakeFd)
+    : index_{index}
+    , wakeFd_{wakeFd}
+    , worker_{[this]() { run(); }}
   {
-    
   }
 
-  std::vector<LobbyEntry> collectEntries()
+  LobbyShard(const LobbyShard&) = delete;
+  LobbyShard& operator=(const LobbyShard&) = delete;
+
+  ~LobbyShard()
   {
-    std::vector<LobbyEntry> lobbies;
-    lobbies.reserve(lobbies_.size());
-    for (auto[id, lobby] : lobbies_)
+    stopping_.store(true);
+    wake();
+    worker_.join();
+  }
+
+  // Front-end thread only
+  void post(Command command)
+  {
+    while (!commands_.push(std::move(command)))
     {
-      auto& name = lobbies.emplace_back(LobbyEntry{
-          .name = {0},
-          .id = id,
-          .playerCount = static_cast<uint32_t>(lobby.players.size()),
-          .botCount = lobby.botCount,
-        }).name;
-      std::strncpy(name.data(), lobby.name.c_str(), name.size() - 1);
+      // The shard never waits on us, it will make room
+      wake();
+      std::this_thread::yield();
     }
+    wake();
+  }
 
-    return lobbies;
+  // Front-end thread only
+  void takeEvents(std::vector<Event>& events)
+  {
+    std::lock_guard lock{eventsMutex_};
+    events.swap(events_);
   }
 
-  void broadcastLobbies()
+ private:
+  void wake()
   {
-    auto lobbies = collectEntries();
-    for (auto peer : clients_)
+    pending_.store(true);
+    pending_.notify_one();
+  }
+
+  void run()
+  {
+    Command command;
+    while (true)
     {
-      send(peer, 0, ENET_PACKET_FLAG_RELIABLE,
-        PLobbyListUpdate{}, std::span{lobbies.data(), lobbies.size()});
+      pending_.wait(false);
+      // Has to read what wake() stored, a plain store could overwrite a
+      // newer true without making its command visible
+      pending_.exchange(false, std::memory_order_acquire);
+
+      while (commands_.pop(command))
+      {
+        std::visit([this](auto& c) { handle(c); }, command);
+      }
+      flushEvents();
+
+      if (stopping_.load()) return;
     }
   }
 
-  bool removeFromLobby(ENetPeer* peer, uint32_t id, Lobby& lobby)
+  void flushEvents()
   {
-    auto it = std::find(lobby.players.begin(), lobby.players.end(), peer);
-    if (it == lobby.players.end())
+    if (outbox_.empty()) return;
+
     {
-      return false;
+      std::lock_guard lock{eventsMutex_};
+      std::move(outbox_.begin(), outbox_.end(), std::back_inserter(events_));
     }
-  
-    std::swap(*it, lobby.players.back());
-    lobby.players.pop_back();
+    outbox_.clear();
 
-    lobbies_.erase(id);
-    
-    return true;
+#ifndef _WIN32
+    if (wakeFd_ != -1)
+    {
+      const uint64_t one = 1;
+      [[maybe_unused]] auto written = ::write(wakeFd_, &one, sizeof(one));
+    }
+#endif
+  }
+
+  void handle(Create& command)
+  {
+    auto& lobby = lobbies_.emplace(command.id, Lobby{
+      .name = std::move(command.name),
+      .botCount = command.botCount,
+    }).first->second;
+    lobbyIndex_.insert(command.id, lobby.name, 0);
+    changed_ = true;
+
+    for (auto peer : command.players)
+    {
+      join(peer, command.id, lobby);
+    }
+
+    if (command.start)
+    {
+      start(command.id);
+    }
   }
 
-  void removeFromLobby(ENetPeer* peer)
+  void handle(const Join& command)
   {
-    for (auto[id, lobby] : lobbies_)
+    auto it = lobbies_.find(command.id);
+    if (it == lobbies_.end())
     {
-      if (removeFromLobby(peer, id, lobby))
+      outbox_.push_back(JoinFailed{ .peer = command.peer, .id = command.id });
+      return;
+    }
+
+    join(command.peer, command.id, it->second);
+  }
+
+  void handle(const Leave& command)
+  {
+    if (auto member = members_.find(command.peer); member != members_.end() && member->second.lobbyId == command.id)
+    {
+      leave(command.peer);
+    }
+  }
+
+  void handle(const Start& command)
+  {
+    start(command.id);
+  }
+
+  void handle(const Publish&)
+  {
+    if (!std::exchange(changed_, false)) return;
+
+    auto snapshot = std::make_shared<ShardSnapshot>();
+    snapshot->index = lobbyIndex_;
+    snapshot->entries.reserve(lobbies_.size());
+    for (const auto&[id, lobby] : lobbies_)
+    {
+      snapshot->entries.emplace(id, entryOf(id, lobby));
+    }
+    outbox_.push_back(Published{ .shard = index_, .snapshot = std::move(snapshot) });
+  }
+
+  void join(ENetPeer* peer, uint32_t id, Lobby& lobby)
+  {
+    if (auto member = members_.find(peer); member != members_.end())
+    {
+      if (member->second.lobbyId == id)
       {
-        break;
+        outbox_.push_back(Joined{ .peer = peer, .id = id });
+        return;
       }
+      leave(peer);
+    }
+
+    auto& member = members_.emplace(peer, Member{ .peer = peer, .lobbyId = id }).first->second;
+    member.next = lobby.players;
+    if (lobby.players != nullptr)
+    {
+      lobby.players->prev = &member;
     }
+    lobby.players = &member;
+    ++lobby.playerCount;
+
+    lobbyIndex_.setPlayerCount(id, lobby.playerCount);
+    changed_ = true;
+    outbox_.push_back(Joined{ .peer = peer, .id = id });
   }
 
-  void handlePacket(ENetPeer* peer, enet_uint8, const PCreateLobby& packet)
+  // The lobby goes away with its last player
+  void leave(ENetPeer* peer)
   {
-    removeFromLobby(peer);
+    auto it = members_.find(peer);
+    if (it == members_.end()) return;
 
-    auto lobby = lobbies_.emplace(lobbyIdCounter_++, Lobby{
-      .name = std::string(packet.name.data(), packet.name.size()),
-      .botCount = packet.botCount,
-      .players = {peer},
-    }).first;
-    spdlog::info("Creating lobby {}", lobby->second.name);
+    auto& member = it->second;
+    const auto id = member.lobbyId;
+    auto lobby = lobbies_.find(id);
+    NG_ASSERT(lobby != lobbies_.end());
 
-    send(peer, 0, ENET_PACKET_FLAG_RELIABLE,
-      PJoinedLobby{ .id = lobby->first, });
+    if (member.prev != nullptr)
+    {
+      member.prev->next = member.next;
+    }
+    else
+    {
+      lobby->second.players = member.next;
+    }
+    if (member.next != nullptr)
+    {
+      member.next->prev = member.prev;
+    }
+    members_.erase(it);
+    changed_ = true;
 
-    broadcastLobbies();
+    if (--lobby->second.playerCount == 0)
+    {
+      lobbyIndex_.erase(id, lobby->second.name);
+      lobbies_.erase(lobby);
+    }
+    else
+    {
+      lobbyIndex_.setPlayerCount(id, lobby->second.playerCount);
+    }
   }
 
-  void handlePacket(ENetPeer* peer, enet_uint8, const PJoinLobby& packet)
+  void start(uint32_t id)
   {
-    auto it = lobbies_.find(packet.id);
-    if (it == lobbies_.end()) return;
-    auto& players = it->second.players;
-
-    if (std::find(players.begin(), players.end(), peer) != players.end())
+    auto it = lobbies_.find(id);
+    if (it == lobbies_.end())
     {
+      outbox_.push_back(StartFailed{ .id = id });
       return;
     }
 
-    removeFromLobby(peer);
+    lobbyIndex_.erase(id, it->second.name);
+    changed_ = true;
+
+    Started started{
+      .id = id,
+      .name = std::move(it->second.name),
+      .botCount = it->second.botCount,
+      .players = {},
+    };
+    started.players.reserve(it->second.playerCount);
+    for (Member* member = it->second.players; member != nullptr;)
+    {
+      auto peer = member->peer;
+      member = member->next;
+      started.players.push_back(peer);
+      members_.erase(peer);
+    }
 
-    it->second.players.push_back(peer);
+    lobbies_.erase(it);
+    outbox_.push_back(std::move(started));
+  }
 
-    spdlog::info("Player joined lobby {}", it->second.name);
+ private:
+  size_t index_;
 
-    send(peer, 0, ENET_PACKET_FLAG_RELIABLE,
-      PJoinedLobby{ .id = packet.id, });
+  // Both node based, Member and Lobby addresses are stable
+  std::unordered_map<uint32_t, Lobby> lobbies_;
+  std::unordered_map<ENetPeer*, Member> members_;
+  LobbyIndex lobbyIndex_;
+  // Since the last publish
+  bool changed_{false};
+
+  SpscQueue<Command, 4096> commands_;
+  std::atomic<bool> pending_{false};
+  std::atomic<bool> stopping_{false};
+
+  std::vector<Event> outbox_;
+  std::mutex eventsMutex_;
+  std::vector<Event> events_;
+
+  int wakeFd_;
+  // Last, everything above must exist before it starts running
+  std::thread worker_;
+};
 
-    broadcastLobbies();
+// What the lobby knows about a game server, refreshed by its PServerLoad
+// reports and adjusted optimistically for every match placed in between
+struct GameServer
+{
+  // Servers this busy get no new matches
+  static constexpr float kMaxLoad = 0.9f;
+
+  ENetPeer* peer;
+  uint32_t freeMatches;
+  uint32_t playerCount{0};
+  // Zero until the first report arrives
+  uint32_t freePlayerSlots{0};
+  float tickP99Ms{0};
+  float tickBudgetMs{1};
+
+  // The busier of CPU and player capacity, 1 is full
+  float load() const
+  {
+    const auto slots = playerCount + freePlayerSlots;
+    const float players = slots > 0 ? static_cast<float>(playerCount) / static_cast<float>(slots) : 1.f;
+    return std::max(tickP99Ms / tickBudgetMs, players);
   }
 
-  void handlePacket(ENetPeer* peer, enet_uint8, const PLeaveLobby& packet)
+  bool fits(uint32_t players) const
+  {
+    return freeMatches > 0 && freePlayerSlots >= players && load() < kMaxLoad;
+  }
+};
+
+// The I/O front-end: owns the ENet host, clients, game servers, matchmaking
+// and list subscriptions, and routes everything about a particular lobby to
+// the shard that owns it. Its own peer to lobby map is updated as commands
+// go out, so a player is never sent into two lobbies at once.
+class LobbyService
+  : public Service<LobbyService, true>
+{
+  using Clock = std::chrono::steady_clock;
+ public:
+  LobbyService(ENetAddress addr, size_t shardCount)
+    : Service(&addr, ENET_PROTOCOL_MAXIMUM_PEER_ID, 2)
   {
-    auto it = lobbies_.find(packet.id);
-    if (it == lobbies_.end()) return;
-    
-    removeFromLobby(peer, packet.id, it->second);
+#ifndef _WIN32
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    NG_VERIFY(wakeFd_ != -1);
+#endif
 
-    broadcastLobbies();
+    shards_.reserve(shardCount);
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+      shards_.emplace_back(std::make_unique<LobbyShard>(i, wakeFd_));
+    }
+    snapshots_.resize(shardCount);
   }
 
-  void handlePacket(ENetPeer*, enet_uint8, const PStartLobby& packet)
+  ~LobbyService()
+  {
+    shards_.clear();
+#ifndef _WIN32
+    ::close(wakeFd_);
+#endif
+  }
+
+  // Service::poll wakes up on this as well as on the socket
+  int inputFd() const { return wakeFd_; }
+
+  LobbyShard& shardOf(uint32_t lobbyId)
+  {
+    return *shards_[lobbyId % shards_.size()];
+  }
+
+  // Merges the first offset + limit matches of every shard, so deeper
+  // pages cost proportionally more
+  uint32_t queryPage(const LobbyQuery& query, std::vector<const LobbyEntry*>& page)
+  {
+    LobbyQuery head = query;
+    head.offset = 0;
+    head.limit = query.offset + query.limit;
+
+    page.clear();
+    uint32_t total = 0;
+    for (const auto& snapshot : snapshots_)
+    {
+      if (snapshot == nullptr) continue;
+
+      total += snapshot->index.query(head, ids_);
+      for (auto id : ids_)
+      {
+        page.push_back(&snapshot->entries.at(id));
+      }
+    }
+
+    const size_t begin = std::min<size_t>(query.offset, page.size());
+    const size_t end = std::min<size_t>(begin + query.limit, page.size());
+    std::partial_sort(page.begin(), page.begin() + static_cast<ptrdiff_t>(end), page.end(),
+      [sort = query.sort](const LobbyEntry* a, const LobbyEntry* b)
+      {
+        return LobbyIndex::before(sort, *a, *b);
+      });
+    page.erase(page.begin() + static_cast<ptrdiff_t>(end), page.end());
+    page.erase(page.begin(), page.begin() + static_cast<ptrdiff_t>(begin));
+
+    return total;
+  }
+
+  // Sorted by id, which is how subscriptions remember what they've sent
+  static std::vector<LobbyCounts> countsOf(std::span<const LobbyEntry* const> page)
+  {
+    std::vector<LobbyCounts> counts;
+    counts.reserve(page.size());
+    for (auto entry : page)
+    {
+      counts.push_back(LobbyCounts{ .id = entry->id, .playerCount = entry->playerCount, .botCount = entry->botCount });
+    }
+    std::sort(counts.begin(), counts.end(),
+      [](const LobbyCounts& a, const LobbyCounts& b) { return a.id < b.id; });
+    return counts;
+  }
+
+  // Every subscriber gets its page re-queried and diffed against what it
+  // was sent last, and hears nothing unless that page actually changed
+  void broadcastChanges()
+  {
+    if (!listChanged_) return;
+    listChanged_ = false;
+    ++listVersion_;
+
+    std::vector<const LobbyEntry*> page;
+    std::vector<LobbyEntry> added;
+    std::vector<LobbyCounts> updated;
+    std::vector<uint32_t> removed;
+    for (auto&[peer, subscription] : subscriptions_)
+    {
+      const auto total = queryPage(subscription.query, page);
+      auto counts = countsOf(page);
+
+      added.clear();
+      updated.clear();
+      removed.clear();
+      auto sent = subscription.sent.begin();
+      for (const auto& current : counts)
+      {
+        for (; sent != subscription.sent.end() && sent->id < current.id; ++sent)
+        {
+          removed.push_back(sent->id);
+        }
+
+        if (sent == subscription.sent.end() || sent->id != current.id)
+        {
+          added.push_back(**std::find_if(page.begin(), page.end(),
+            [id = current.id](const LobbyEntry* entry) { return entry->id == id; }));
+          continue;
+        }
+
+        if (sent->playerCount != current.playerCount || sent->botCount != current.botCount)
+        {
+          updated.push_back(current);
+        }
+        ++sent;
+      }
+      for (; sent != subscription.sent.end(); ++sent)
+      {
+        removed.push_back(sent->id);
+      }
+
+      if (added.empty() && updated.empty() && removed.empty() && total == subscription.total)
+      {
+        continue;
+      }
+
+      subscription.sent = std::move(counts);
+      subscription.total = total;
+
+      ByteOstream s;
+      s << std::span{added.data(), added.size()}
+        << std::span{updated.data(), updated.size()}
+        << std::span{removed.data(), removed.size()};
+      auto delta = std::move(s).finalize();
+
+      send(peer, 0, ENET_PACKET_FLAG_RELIABLE,
+        PLobbyListDelta{ .version = listVersion_, .total = total }, std::span{delta.data(), delta.size()});
+    }
+  }
+
+  // The shard confirms with a Joined event, or a JoinFailed that undoes this
+  void join(ENetPeer* peer, uint32_t id)
   {
-    if (servers_.empty())
+    leave(peer);
+    matchmaking_.remove(peer);
+    members_[peer] = id;
+  }
+
+  void leave(ENetPeer* peer)
+  {
+    auto it = members_.find(peer);
+    if (it == members_.end()) return;
+
+    const auto id = it->second;
+    members_.erase(it);
+
+    if (auto pending = pendingStarts_.find(id); pending != pendingStarts_.end())
     {
-      spdlog::error("No servers to send clients to!");
+      std::erase(pending->second.players, peer);
       return;
     }
 
-    auto it = lobbies_.find(packet.id);
-    if (it == lobbies_.end())
+    shardOf(id).post(LobbyShard::Leave{ .peer = peer, .id = id });
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PCreateLobby& packet)
+  {
+    if (!clients_.contains(peer)) return;
+
+    const auto id = lobbyIdCounter_++;
+    auto name = std::string(packet.name.data(), strnlen(packet.name.data(), packet.name.size()));
+    spdlog::info("Creating lobby {}", name);
+
+    join(peer, id);
+    shardOf(id).post(LobbyShard::Create{
+      .id = id,
+      .name = std::move(name),
+      .botCount = packet.botCount,
+      .players = {peer},
+      .start = false,
+    });
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PJoinLobby& packet)
+  {
+    if (!clients_.contains(peer)) return;
+
+    if (auto member = members_.find(peer); member != members_.end() && member->second == packet.id)
     {
-      spdlog::error("Trying to start a non-existing lobby!");
       return;
     }
 
-    Lobby lobby = std::move(it->second);
-    lobbies_.erase(it);
+    join(peer, packet.id);
+    shardOf(packet.id).post(LobbyShard::Join{ .peer = peer, .id = packet.id });
+  }
 
+  void handlePacket(ENetPeer* peer, enet_uint8, const PLeaveLobby& packet)
+  {
+    if (auto member = members_.find(peer); member != members_.end() && member->second == packet.id)
+    {
+      leave(peer);
+    }
+  }
+
+  void handlePacket(ENetPeer*, enet_uint8, const PStartLobby& packet)
+  {
+    if (pendingStarts_.contains(packet.id)) return;
+
+    shardOf(packet.id).post(LobbyShard::Start{ .id = packet.id });
+  }
 
-    auto server = servers_.back();
-    servers_.pop_back();
+  // A started lobby, out of its shard and waiting for a server
+  struct PendingStart
+  {
+    std::string name;
+    uint32_t botCount;
+    std::vector<ENetPeer*> players;
+  };
 
-    send(server, 0, ENET_PACKET_FLAG_RELIABLE, PStartServerGame{ .botCount = lobby.botCount });
-    disconnect(server, [](){});
+  GameServer* pickServer(uint32_t players)
+  {
+    GameServer* best = nullptr;
+    for (auto& server : servers_)
+    {
+      if (server.fits(players) && (best == nullptr || server.load() < best->load()))
+      {
+        best = &server;
+      }
+    }
+    return best;
+  }
 
-    spdlog::info("Sending {} clients from lobby {} (id {}) to server {}:{}!",
-      lobby.players.size(), lobby.name, packet.id, server->address.host, server->address.port);
+  // False if no server can take the lobby right now
+  bool tryStart(uint32_t id, const PendingStart& lobby)
+  {
+    const auto playerCount = static_cast<uint32_t>(lobby.players.size());
+    auto server = pickServer(playerCount);
+    if (server == nullptr) return false;
+
+    // The next load report corrects these
+    --server->freeMatches;
+    server->freePlayerSlots -= playerCount;
+    server->playerCount += playerCount;
+
+    send(server->peer, 0, ENET_PACKET_FLAG_RELIABLE,
+      PStartServerGame{ .botCount = lobby.botCount, .matchId = id });
+
+    spdlog::info("Sending {} clients from lobby {} (id {}) to server {}:{} at load {:.2f}!",
+      playerCount, lobby.name, id, server->peer->address.host, server->peer->address.port, server->load());
 
     for (auto peer : lobby.players)
     {
       send(peer, 0, ENET_PACKET_FLAG_RELIABLE,
         PLobbyStarted{
-          .serverAddress = server->address,
+          .serverAddress = server->peer->address,
+          .matchId = id,
         });
+      members_.erase(peer);
+    }
+
+    return true;
+  }
+
+  // Called whenever server capacity may have changed. Lobbies that emptied
+  // while waiting are dropped, the rest start in order wherever they fit.
+  void drainStartQueue()
+  {
+    std::erase_if(startQueue_,
+      [this](uint32_t id)
+      {
+        auto it = pendingStarts_.find(id);
+        NG_ASSERT(it != pendingStarts_.end());
+        if (!it->second.players.empty() && !tryStart(id, it->second)) return false;
+
+        pendingStarts_.erase(it);
+        return true;
+      });
+  }
+
+  // Matched players get a lobby of their own that starts right away,
+  // so from there on they go the same way as a manually started one
+  void formMatches(Clock::time_point now)
+  {
+    matchmaking_.formMatches(now,
+      [this](uint32_t botCount, std::span<ENetPeer* const> players)
+      {
+        const auto id = lobbyIdCounter_++;
+        for (auto peer : players)
+        {
+          join(peer, id);
+        }
+
+        shardOf(id).post(LobbyShard::Create{
+          .id = id,
+          .name = fmt::format("Matchmaking #{}", id),
+          .botCount = botCount,
+          .players = {players.begin(), players.end()},
+          .start = true,
+        });
+      });
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PFindMatch& packet)
+  {
+    if (!clients_.contains(peer)) return;
+
+    leave(peer);
+    // ENet's smoothed RTT, the client has been talking to us for a while by now
+    matchmaking_.enqueue(peer, peer->roundTripTime, packet.botCount, Clock::now());
+  }
+
+  void handlePacket(ENetPeer* peer, enet_uint8, const PCancelFindMatch&)
+  {
+    matchmaking_.remove(peer);
+  }
+
+  // Shard events may be about players who have moved on since the command
+  // went out, members_ has the final say on where everyone is
+  void handleEvent(LobbyShard::Joined& event)
+  {
+    if (auto member = members_.find(event.peer); member == members_.end() || member->second != event.id)
+    {
+      return;
+    }
+
+    send(event.peer, 0, ENET_PACKET_FLAG_RELIABLE,
+      PJoinedLobby{ .id = event.id, });
+  }
+
+  void handleEvent(LobbyShard::JoinFailed& event)
+  {
+    if (auto member = members_.find(event.peer); member != members_.end() && member->second == event.id)
+    {
+      members_.erase(member);
+    }
+  }
+
+  void handleEvent(LobbyShard::Started& event)
+  {
+    PendingStart lobby{
+      .name = std::move(event.name),
+      .botCount = event.botCount,
+      .players = std::move(event.players),
+    };
+    std::erase_if(lobby.players,
+      [this, id = event.id](ENetPeer* peer)
+      {
+        auto member = members_.find(peer);
+        return member == members_.end() || member->second != id;
+      });
+
+    if (lobby.players.empty() || tryStart(event.id, lobby)) return;
+
+    startQueue_.push_back(event.id);
+    spdlog::warn("No server can take lobby {} right now, {} lobbies waiting",
+      lobby.name, startQueue_.size());
+    pendingStarts_.emplace(event.id, std::move(lobby));
+  }
+
+  void handleEvent(LobbyShard::StartFailed&)
+  {
+    spdlog::error("Trying to start a non-existing lobby!");
+  }
+
+  void handleEvent(LobbyShard::Published& event)
+  {
+    snapshots_[event.shard] = std::move(event.snapshot);
+    listChanged_ = true;
+  }
+
+  void processShardEvents()
+  {
+#ifndef _WIN32
+    uint64_t count;
+    [[maybe_unused]] auto read = ::read(wakeFd_, &count, sizeof(count));
+#endif
+
+    for (auto& shard : shards_)
+    {
+      shard->takeEvents(events_);
+      for (auto& event : events_)
+      {
+        std::visit([this](auto& e) { handleEvent(e); }, event);
+      }
+      events_.clear();
     }
   }
 
@@ -176,26 +800,72 @@ class LobbyService
   {
     spdlog::info("Client {}:{} registered", client->address.host, client->address.port);
     clients_.emplace(client);
+  }
+
+  void handlePacket(ENetPeer* client, enet_uint8, const PQueryLobbies& packet)
+  {
+    if (!clients_.contains(client)) return;
+
+    auto& subscription = subscriptions_[client];
+    subscription.query = packet.query;
+    subscription.query.limit = std::min(subscription.query.limit, LobbyIndex::kMaxPageSize);
+
+    std::vector<const LobbyEntry*> page;
+    subscription.total = queryPage(subscription.query, page);
+    subscription.sent = countsOf(page);
 
+    std::vector<LobbyEntry> entries;
+    entries.reserve(page.size());
+    for (auto entry : page)
+    {
+      entries.push_back(*entry);
+    }
 
-    auto lobbies = collectEntries();
+    // Changes still on their way from the shards come as the next delta
     send(client, 0, ENET_PACKET_FLAG_RELIABLE,
-      PLobbyListUpdate{}, std::span{lobbies.data(), lobbies.size()});
+      PLobbyListUpdate{ .version = listVersion_, .total = subscription.total },
+      std::span{entries.data(), entries.size()});
   }
 
-  void handlePacket(ENetPeer* server, enet_uint8, const PRegisterServerInLobby&)
+  void handlePacket(ENetPeer* server, enet_uint8, const PRegisterServerInLobby& packet)
   {
-    spdlog::info("Server {}:{} registered", server->address.host, server->address.port);
-    servers_.push_back(server);
+    spdlog::info("Server {}:{} registered with {} free matches",
+      server->address.host, server->address.port, packet.freeMatches);
+    servers_.push_back(GameServer{ .peer = server, .freeMatches = packet.freeMatches });
+  }
+
+  void handlePacket(ENetPeer* server, enet_uint8, const PServerLoad& packet)
+  {
+    auto it = std::find_if(servers_.begin(), servers_.end(),
+      [server](const GameServer& s) { return s.peer == server; });
+    if (it == servers_.end()) return;
+
+    it->freeMatches = packet.freeMatches;
+    it->playerCount = packet.playerCount;
+    it->freePlayerSlots = packet.freePlayerSlots;
+    it->tickP99Ms = packet.tickP99Ms;
+    it->tickBudgetMs = std::max(packet.tickBudgetMs, 1.f);
+
+    if (packet.tickP99Ms > packet.tickBudgetMs)
+    {
+      spdlog::warn("Server {}:{} is overloaded, tick p50 {:.1f} ms, p99 {:.1f} ms, max {:.1f} ms",
+        server->address.host, server->address.port, packet.tickP50Ms, packet.tickP99Ms, packet.tickMaxMs);
+    }
+
+    drainStartQueue();
   }
 
   void disconnected(ENetPeer* peer)
   {
     if (clients_.erase(peer) > 0)
     {
-      removeFromLobby(peer);
+      subscriptions_.erase(peer);
+      matchmaking_.remove(peer);
+      leave(peer);
     }
-    else if (auto it = std::find(servers_.begin(), servers_.end(), peer); it != servers_.end())
+    else if (auto it = std::find_if(servers_.begin(), servers_.end(),
+        [peer](const GameServer& s) { return s.peer == peer; });
+      it != servers_.end())
     {
       std::swap(*it, servers_.back());
       servers_.pop_back();
@@ -204,31 +874,92 @@ class LobbyService
 
   void run()
   {
-    auto lastPollTime = Clock::now();
+    constexpr auto kListUpdateRate = 100ms;
+    constexpr auto kMatchmakingRate = 250ms;
+    constexpr auto kMatchmakingReportRate = 10s;
+
+    auto lastListUpdate = Clock::now();
+    auto lastMatchmaking = lastListUpdate;
+    auto lastMatchmakingReport = lastListUpdate;
     while (true)
     {
       auto now = Clock::now();
-      auto delta = now - std::exchange(lastPollTime, now);
+      if (now - lastMatchmaking > kMatchmakingRate)
+      {
+        lastMatchmaking = now;
+        formMatches(now);
+      }
 
-      UNUSED(delta);
+      // Shards only answer if something changed, the broadcast goes out
+      // once their snapshots have arrived
+      if (now - lastListUpdate > kListUpdateRate)
+      {
+        lastListUpdate = now;
+        for (auto& shard : shards_)
+        {
+          shard->post(LobbyShard::Publish{});
+        }
+      }
+
+      if (now - lastMatchmakingReport > kMatchmakingReportRate)
+      {
+        lastMatchmakingReport = now;
+        if (auto report = matchmaking_.report(); report.matchedPlayers > 0 || report.waitingPlayers > 0)
+        {
+          spdlog::info("Matchmaking: {} players matched, {} waiting, wait p50 {:.0f} ms, p90 {:.0f} ms, p99 {:.0f} ms, max {:.0f} ms",
+            report.matchedPlayers, report.waitingPlayers, report.p50Ms, report.p90Ms, report.p99Ms, report.maxMs);
+        }
+      }
 
+#ifdef _WIN32
+      // Nothing wakes us up when shard events arrive
+      Service::poll(1);
+#else
       Service::poll();
+#endif
+      processShardEvents();
+      broadcastChanges();
     }
   }
 
  private:
   std::unordered_set<ENetPeer*> clients_;
-  std::vector<ENetPeer*> servers_;
+  std::vector<GameServer> servers_;
 
-  std::unordered_map<uint32_t, Lobby> lobbies_;
+  std::vector<std::unique_ptr<LobbyShard>> shards_;
+  int wakeFd_{-1};
+  std::vector<LobbyShard::Event> events_;
+
+  // Where every player is as far as the commands sent so far go
+  std::unordered_map<ENetPeer*, uint32_t> members_;
   uint32_t lobbyIdCounter_{0};
+  // Started lobbies waiting for a server, oldest first
+  std::deque<uint32_t> startQueue_;
+  std::unordered_map<uint32_t, PendingStart> pendingStarts_;
+  MatchmakingQueue matchmaking_;
+
+  // Latest per shard, null until its first publish
+  std::vector<std::shared_ptr<const ShardSnapshot>> snapshots_;
+  std::vector<uint32_t> ids_;
+
+  struct Subscription
+  {
+    LobbyQuery query;
+    // The page as the client has it, sorted by id
+    std::vector<LobbyCounts> sent;
+    uint32_t total{0};
+  };
+  std::unordered_map<ENetPeer*, Subscription> subscriptions_;
+  // Since the last broadcast
+  bool listChanged_{false};
+  uint64_t listVersion_{0};
 };
 
 int main(int argc, char** argv)
 {
-  if (argc != 2)
+  if (argc < 2 || argc > 3)
   {
-    spdlog::error("Usage: {} <lobby port>\n", argv[0]);
+    spdlog::error("Usage: {} <lobby port> [shards]\n", argv[0]);
     return -1;
   }
 
@@ -240,7 +971,14 @@ int main(int argc, char** argv)
     .port = static_cast<uint16_t>(std::atoi(argv[1])),
   };
 
-  LobbyService lobby(address);
+  // One core is left to the front-end
+  const size_t shards = argc == 3
+    ? static_cast<size_t>(std::max(std::atoi(argv[2]), 1))
+    : std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+  spdlog::info("Running {} lobby shards", shards);
+
+  LobbyService lobby(address, shards);
 
   lobby.run();
 
@@ -7,73 +7,176 @@
 #include "common/Service.hpp"
 #include "common/Replication.hpp"
 #include "common/AsyncInput.hpp"
+#include "common/ClockSync.hpp"
+#include "common/JobSystem.hpp"
 #include "common/proto.hpp"
 
 #include "game/Entity.hpp"
+#include "game/EntityIndex.hpp"
+#include "game/Simulation.hpp"
 #include "game/gameProto.hpp"
 
 
 using namespace std::chrono_literals;
 
 
+// One independent game running inside the server process
+struct Match
+{
+  struct ClientData
+  {
+    uint32_t id;
+    id_t entityId;
+  };
+
+  uint32_t id;
+
+  GameState state;
+  EntityIndex index;
+  // AI components, aligned with state
+  BotStates bots;
+  uint64_t tick{0};
+
+  std::unordered_map<ENetPeer*, ClientData> clients;
+  uint32_t idCounter{1};
+
+  std::chrono::steady_clock::time_point createdAt;
+  // When state was last simulated, sent along with every snapshot
+  std::chrono::steady_clock::time_point tickTime;
+
+  void addBots(size_t count)
+  {
+    state.reserve(state.size() + count);
+    bots.reserve(bots.size() + count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      auto id = index.insert(state, Entity::create()).id;
+      bots.emplace_back(BotState::wander(id));
+    }
+  }
+};
+
 class Server
   : public Service<Server, true>
   , public Replication<Server>
+  , public ClockSync<Server>
 {
   using Clock = std::chrono::steady_clock;
  public:
-  Server(ENetAddress addr)
-    : Service(&addr, 32, 2)
+  static constexpr size_t kPlayersPerMatch = 32;
+  static constexpr auto kLoadReportRate = 1s;
+  // Simulating all matches should leave most of the poll interval to the network
+  static constexpr auto kTickBudget = 30ms;
+
+  Server(ENetAddress addr, size_t workerThreads, size_t maxMatches)
+    : Service(&addr, std::min<size_t>(maxMatches*kPlayersPerMatch + 1, ENET_PROTOCOL_MAXIMUM_PEER_ID), 2)
+    , jobs_{workerThreads}
+    , maxMatches_{maxMatches}
+    , playerSlots_{std::min<size_t>(maxMatches*kPlayersPerMatch, ENET_PROTOCOL_MAXIMUM_PEER_ID - 1)}
   {
   }
 
-  void resetGame(size_t bots)
+  uint32_t freeMatches() const
   {
-    state_.clear();
-    botTargets_.clear();
-
-    state_.reserve(bots);
-    botTargets_.reserve(bots);
-    for (size_t i = 0; i < bots; ++i)
-    {
-      auto entity = Entity::create();
-      auto id = state_.emplace_back(entity).id;
-      botTargets_.emplace(id, Entity::randomPos());
-    }
+    return static_cast<uint32_t>(maxMatches_ - std::min(maxMatches_, matches_.size()));
   }
 
   void registerInLobby(char* addr, uint16_t port)
   {
-    // kostyl
-    static ENetAddress address;
-    if (addr != nullptr)
-    {
-      enet_address_set_host(&address, addr);
-      address.port = port;
-    }
-    
+    ENetAddress address;
+    enet_address_set_host(&address, addr);
+    address.port = port;
+
     connect(address,
       [this](ENetPeer* lobby)
       {
         NG_VERIFY(lobby != nullptr);
+        lobby_ = lobby;
         send(lobby, 0, ENET_PACKET_FLAG_RELIABLE,
-          PRegisterServerInLobby{});
+          PRegisterServerInLobby{ .freeMatches = freeMatches() });
+        reportLoad();
+      });
+  }
+
+  static float percentile(std::vector<float>& samples, float p)
+  {
+    if (samples.empty()) return 0;
+
+    auto nth = samples.begin() + static_cast<ptrdiff_t>(p*static_cast<float>(samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+  }
+
+  void reportLoad()
+  {
+    // Nobody to report to, don't let the samples pile up meanwhile
+    if (lobby_ == nullptr)
+    {
+      tickSamplesMs_.clear();
+      return;
+    }
+
+    const auto players = peerMatches_.size();
+    send(lobby_, 0, ENET_PACKET_FLAG_RELIABLE,
+      PServerLoad{
+        .freeMatches = freeMatches(),
+        .playerCount = static_cast<uint32_t>(players),
+        .freePlayerSlots = static_cast<uint32_t>(playerSlots_ - std::min(playerSlots_, players)),
+        .tickP50Ms = percentile(tickSamplesMs_, 0.5f),
+        .tickP99Ms = percentile(tickSamplesMs_, 0.99f),
+        .tickMaxMs = percentile(tickSamplesMs_, 1.f),
+        .tickBudgetMs = std::chrono::duration<float, std::milli>(kTickBudget).count(),
       });
+    tickSamplesMs_.clear();
+  }
+
+  // Players may connect before the lobby's start command arrives. Null if
+  // that would be more matches than we advertised.
+  Match* matchFor(uint32_t id)
+  {
+    if (auto it = matches_.find(id); it != matches_.end()) return &it->second;
+
+    if (matches_.size() >= maxMatches_)
+    {
+      spdlog::warn("Refusing match {}, already running all {} we advertised", id, maxMatches_);
+      return nullptr;
+    }
+
+    auto& match = matches_[id];
+    match.id = id;
+    match.createdAt = Clock::now();
+    match.tickTime = match.createdAt;
+    return &match;
+  }
+
+  void closeMatch(uint32_t id)
+  {
+    matches_.erase(id);
+    spdlog::info("Match {} is over, {} free match slots", id, freeMatches());
+    reportLoad();
   }
 
   using Replication::handlePacket;
+  using ClockSync::handlePacket;
 
-  void handlePacket(ENetPeer* peer, enet_uint8, const PStartServerGame& packet)
+  void handlePacket(ENetPeer*, enet_uint8, const PStartServerGame& packet)
   {
-    resetGame(packet.botCount);
-    spdlog::info("Starting game with {} bots as per external command!", packet.botCount);
+    auto* match = matchFor(packet.matchId);
+    if (match == nullptr) return;
+
+    match->addBots(packet.botCount);
+    spdlog::info("Starting match {} with {} bots as per external command!",
+      packet.matchId, packet.botCount);
   }
 
 
   void handlePacket(ENetPeer* peer, enet_uint8, PChat packet)
   {
-    packet.player = clients_.at(peer).id;
-    for (auto&[client, data] : clients_)
+    auto* match = matchOf(peer);
+    if (match == nullptr) return;
+
+    packet.player = match->clients.at(peer).id;
+    for (auto&[client, data] : match->clients)
     {
       if (client == peer) continue;
 
@@ -81,9 +184,17 @@ class Server
     }
   }
 
-  void connected(ENetPeer* peer)
+  void connected(ENetPeer* peer, enet_uint32 matchId)
   {
-    spdlog::info("{}:{} joined", peer->address.host, peer->address.port);
+    auto* joined = matchFor(matchId);
+    if (joined == nullptr)
+    {
+      disconnect(peer, []() {});
+      return;
+    }
+    auto& match = *joined;
+
+    spdlog::info("{}:{} joined match {}", peer->address.host, peer->address.port, matchId);
 
     send(peer, 0, ENET_PACKET_FLAG_RELIABLE, PSendKey{
       .key = TOP_SECRET_KEY,
@@ -92,12 +203,15 @@ class Server
     setKeyFor(peer, TOP_SECRET_KEY);
     setupReplication(peer, 1);
 
-    auto id = idCounter_++;
+    peerMatches_[peer] = matchId;
 
+    auto id = match.idCounter++;
 
-    auto& playerEntity = state_.emplace_back(Entity::create());
 
-    clients_.emplace(peer, ClientData{
+    auto& playerEntity = match.index.insert(match.state, Entity::create());
+    match.bots.emplace_back();
+
+    match.clients.emplace(peer, Match::ClientData{
         .id = id,
         .entityId = playerEntity.id,
       });
@@ -108,7 +222,7 @@ class Server
       });
 
 
-    for (auto&[client, data] : clients_)
+    for (auto&[client, data] : match.clients)
     {
       if (client == peer) continue;
 
@@ -119,28 +233,26 @@ class Server
         PPlayerJoined{ .id = data.id });
     }
 
-    broadcastDeltas();
+    broadcastDeltas(match);
   }
 
-  Entity* entityById(id_t id)
+  Match* matchOf(ENetPeer* peer)
   {
-    auto& entities = state_;
-    auto it = std::find_if(entities.begin(), entities.end(),
-      [id](const Entity& e) { return e.id == id; });
-    if (it == entities.end())
-      return nullptr;
-    
-    return &*it;
+    auto it = peerMatches_.find(peer);
+    if (it == peerMatches_.end()) return nullptr;
+
+    auto match = matches_.find(it->second);
+    return match == matches_.end() ? nullptr : &match->second;
   }
 
   void handleReplication(ENetPeer* peer, enet_uint8, std::span<const std::byte> bytes)
   {
     NG_ASSERT(bytes.size() == sizeof(glm::uint));
 
-    auto it = clients_.find(peer);
-    if (it == clients_.end()) return;
+    auto* match = matchOf(peer);
+    if (match == nullptr) return;
 
-    auto* entity = entityById(it->second.entityId);
+    auto* entity = match->index.find(match->state, match->clients.at(peer).entityId);
 
     if (entity == nullptr) return;
 
@@ -160,105 +272,88 @@ class Server
   void disconnected(ENetPeer* peer)
   {
     spdlog::info("{}:{} left", peer->address.host, peer->address.port);
-    
-    auto it = clients_.find(peer);
-    if (it == clients_.end())
+
+    if (peer == lobby_)
+    {
+      spdlog::error("Lost connection to the lobby, no new matches will arrive!");
+      lobby_ = nullptr;
+      return;
+    }
+
+    auto* match = matchOf(peer);
+    peerMatches_.erase(peer);
+    if (match == nullptr)
     {
       return;
     }
 
+    auto it = match->clients.find(peer);
     ClientData erasedData = std::move(it->second);
-    clients_.erase(it);
+    match->clients.erase(it);
     stopReplication(peer, 1);
 
-    for (auto&[client, data] : clients_)
+    for (auto&[client, data] : match->clients)
     {
       send(client, 0, ENET_PACKET_FLAG_RELIABLE,
         PPlayerLeft{ .id = erasedData.id });
     }
 
-    if (clients_.empty())
+    if (match->clients.empty())
     {
-      spdlog::info("All players left, requeueing in lobby");
-      state_.clear();
-      botTargets_.clear();
-      registerInLobby(nullptr, 0);
+      spdlog::info("All players left match {}", match->id);
+      closeMatch(match->id);
     }
   }
 
-  void updateLogic(float delta)
+  void updateLogic(Match& match, float delta)
   {
-    auto& entities = state_;
-
-    for (auto& entity : entities)
-    {
-      if (botTargets_.contains(entity.id))
-      {
-        auto v = botTargets_[entity.id] - entity.pos;
-        auto len = glm::length(v);
-
-        if (len < 1e-3)
-        {
-          botTargets_[entity.id] = Entity::randomPos();
-          continue;
-        }
-
-        entity.vel = v / len * 0.2f;
-      }
-
-      entity.simulate(delta);
-    }
-
-    for (auto& e1 : entities)
+#ifndef NDEBUG
+    // Every now and then check the parallel tick against the serial one
+    constexpr uint64_t kVerifyEveryTicks = 64;
+    if (jobs_.workerCount() > 0 && match.tick % kVerifyEveryTicks == 0)
     {
-      for (auto& e2 : entities)
-      {
-        if (&e1 == &e2) continue;
-
-        if (glm::length(e1.pos - e2.pos) + e1.size < e2.size)
-        {
-          e2.size += e1.size/2;
-          e1.size /= 2;
-
-          e1.pos = Entity::randomPos();
-        }
-      }
+      auto referenceState = match.state;
+      auto referenceIndex = match.index;
+      auto referenceBots = match.bots;
+      referenceSimulation_.tick(referenceState, referenceIndex, referenceBots, delta, match.tick);
+      simulation_.tick(match.state, match.index, match.bots, delta, match.tick);
+
+      NG_ASSERTF(referenceState.size() == match.state.size()
+        && std::memcmp(referenceState.data(), match.state.data(), match.state.size()*sizeof(Entity)) == 0
+        && referenceBots == match.bots,
+        "Parallel tick diverged from the serial reference!");
+
+      ++match.tick;
+      return;
     }
+#endif
 
-    for (size_t i = 0; i < entities.size();)
-    {
-      if (entities[i].size < 1e-3)
-      {
-        std::swap(entities[i], entities.back());
-        entities.pop_back();
-      }
-      else
-      {
-        ++i;
-      }
-    }
+    simulation_.tick(match.state, match.index, match.bots, delta, match.tick++);
   }
 
-  void broadcastDeltas()
+  void broadcastDeltas(Match& match)
   {
-    if (clients_.empty()) return;
+    if (match.clients.empty()) return;
 
-    std::vector<std::byte> state(state_.size()*sizeof(Entity));
-    std::memcpy(state.data(), state_.data(), state.size());
+    std::vector<std::byte> state(match.state.size()*sizeof(Entity));
+    std::memcpy(state.data(), match.state.data(), state.size());
 
-    for (auto&[to, clientData] : clients_)
+    for (auto&[to, clientData] : match.clients)
     {
-      replicate(to, 1, {state.data(), state.size()});
+      replicate(to, 1, {state.data(), state.size()}, toWireTime(match.tickTime));
     }
   }
 
   void run()
   {
     constexpr auto kSendRate = 100ms;
+    // Matches nobody showed up to are given back to the lobby
+    constexpr auto kAbandonedMatchTimeout = 30s;
 
     auto startTime = Clock::now();
     auto currentTime = startTime;
     auto lastSendTime = startTime;
+    auto lastLoadReport = startTime;
 
     while (true)
     {
@@ -267,16 +362,47 @@ class Server
         std::chrono::duration_cast<std::chrono::duration<float>>(
           now - std::exchange(currentTime, now)).count();
 
-      if (clients_.size() > 0)
+      const bool send = (now - lastSendTime) > kSendRate;
+      if (send)
       {
-        updateLogic(delta);
+        lastSendTime = now;
       }
 
-      if ((now - lastSendTime) > kSendRate)
+      const auto tickStart = Clock::now();
+      std::vector<uint32_t> abandoned;
+      for (auto&[id, match] : matches_)
       {
-        lastSendTime = now;
+        if (match.clients.empty())
+        {
+          if (now - match.createdAt > kAbandonedMatchTimeout)
+          {
+            abandoned.push_back(id);
+          }
+          continue;
+        }
 
-        broadcastDeltas();
+        updateLogic(match, delta);
+        match.tickTime = now;
+
+        if (send)
+        {
+          broadcastDeltas(match);
+        }
+      }
+
+      tickSamplesMs_.push_back(
+        std::chrono::duration<float, std::milli>(Clock::now() - tickStart).count());
+
+      for (auto id : abandoned)
+      {
+        spdlog::warn("Nobody joined match {}", id);
+        closeMatch(id);
+      }
+
+      if (now - lastLoadReport > kLoadReportRate)
+      {
+        lastLoadReport = now;
+        reportLoad();
       }
 
       Service::poll();
@@ -284,28 +410,33 @@ class Server
   }
 
  private:
-  GameState state_;
+  using ClientData = Match::ClientData;
 
-  std::unordered_map<id_t, glm::vec2> botTargets_;
+  JobSystem jobs_;
+  Simulation simulation_{jobs_};
 
+#ifndef NDEBUG
+  JobSystem serialJobs_{0};
+  Simulation referenceSimulation_{serialJobs_};
+#endif
 
-  struct ClientData
-  {
-    uint32_t id;
-    id_t entityId;
-  };
+  size_t maxMatches_;
+  size_t playerSlots_;
+  std::unordered_map<uint32_t, Match> matches_;
+  std::unordered_map<ENetPeer*, uint32_t> peerMatches_;
 
-  std::unordered_map<ENetPeer*, ClientData> clients_;
-  uint32_t idCounter_{1};
+  ENetPeer* lobby_{nullptr};
+  // Since the last load report
+  std::vector<float> tickSamplesMs_;
 
   constexpr static XorKey TOP_SECRET_KEY { '\xDE', '\xAD', '\xBE', '\xEF' };
 };
 
 int main(int argc, char** argv)
 {
-  if (argc != 4)
+  if (argc < 4 || argc > 6)
   {
-    spdlog::error("Usage: {} <server port> <lobby address> <lobby port>\n", argv[0]);
+    spdlog::error("Usage: {} <server port> <lobby address> <lobby port> [max matches] [worker threads, 0 = serial]\n", argv[0]);
     return -1;
   }
 
@@ -317,7 +448,17 @@ int main(int argc, char** argv)
     .port = static_cast<uint16_t>(std::atoi(argv[1])),
   };
 
-  Server server(address);
+  const size_t maxMatches = argc >= 5
+    ? static_cast<size_t>(std::max(std::atoi(argv[4]), 1))
+    : 8;
+
+  const size_t workerThreads = argc == 6
+    ? static_cast<size_t>(std::atoi(argv[5]))
+    : std::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+  spdlog::info("Hosting up to {} matches, simulating on {} worker threads", maxMatches, workerThreads);
+
+  Server server(address, workerThreads, maxMatches);
 
   server.registerInLobby(argv[2], static_cast<uint16_t>(std::atoi(argv[3])));
 